@@ -7,6 +7,7 @@
 //
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
+// * To get buffers for several blocks at once, call breadn.
 // * After changing buffer data, call bwrite to write it to disk.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
@@ -23,9 +24,23 @@
 #include "fs.h"
 #include "buf.h"
 
+// Block contents live in chunks from kallocpages() that
+// bsetsize() allocates for the file system's block size:
+// about as much memory as MAXNBUF of the smallest blocks, so
+// small blocks get more buffers, but never fewer than NBUF.
+#define BCACHEBYTES (MAXNBUF * MINBSIZE)
+
+// Unused buffers that breadn() leaves for others beyond the
+// first block of a batch, since a process sleeping on disk
+// I/O holds its batch's buffers: the log's share of NBUF.
+#define BRESERVE (MAXOPBLOCKS*3)
+
 struct {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf buf[MAXNBUF];
+  int nbuf;    // buffers in use at the current block size
+  int order;   // kallocpages() order of each chunk of block data
+  int nper;    // buffers per chunk
 
   // Linked list of all buffers, through prev/next.
   // Sorted by how recently the buffer was used.
@@ -39,26 +54,70 @@ binit(void)
   struct buf *b;
 
   initlock(&bcache.lock, "bcache");
+  for(b = bcache.buf; b < bcache.buf+MAXNBUF; b++)
+    initsleeplock(&b->lock, "buffer");
+
+  // Until fsinit() reads the super block, use the smallest size.
+  bsetsize(MINBSIZE);
+}
+
+// Resize every buffer to hold blocks of size bytes and
+// discard the cache's contents. fsinit() calls this once
+// with the block size recorded in the super block, when no
+// buffer is in use.
+void
+bsetsize(uint size)
+{
+  struct buf *b;
+  int n, i;
+
+  acquire(&bcache.lock);
+  for(b = bcache.buf; b < bcache.buf+bcache.nbuf; b++)
+    if(b->refcnt != 0)
+      panic("bsetsize: busy");
+
+  // free the old block data, one chunk per nper buffers.
+  for(i = 0; i < bcache.nbuf; i += bcache.nper)
+    kfreepages(bcache.buf[i].data, bcache.order);
+
+  n = BCACHEBYTES / size;
+  if(n < NBUF)
+    n = NBUF;
+  if(n > MAXNBUF)
+    n = MAXNBUF;
+  bcache.nbuf = n;
+  bcache.order = korder(size);
+  bcache.nper = (PGSIZE << bcache.order) / size;
 
   // Create linked list of buffers
   bcache.head.prev = &bcache.head;
   bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
+  for(b = bcache.buf; b < bcache.buf+n; b++){
+    i = b - bcache.buf;
+    if(i % bcache.nper == 0){
+      if((b->data = kallocpages(bcache.order)) == 0)
+        panic("bsetsize: out of memory");
+    } else
+      b->data = bcache.buf[i - i % bcache.nper].data + (i % bcache.nper) * size;
+    b->valid = 0;
+    b->size = size;
     b->next = bcache.head.next;
     b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
     bcache.head.next->prev = b;
     bcache.head.next = b;
   }
+  release(&bcache.lock);
 }
 
 // Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
+// If not found, allocate a buffer, as long as reserve
+// other unused buffers remain; otherwise return 0.
 // In either case, return locked buffer.
 static struct buf*
-bget(uint dev, uint blockno)
+bgetreserve(uint dev, uint blockno, int reserve)
 {
-  struct buf *b;
+  struct buf *b, *nb;
+  int nfree;
 
   acquire(&bcache.lock);
 
@@ -74,18 +133,37 @@ bget(uint dev, uint blockno)
 
   // Not cached.
   // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  b = 0;
+  nfree = 0;
+  for(nb = bcache.head.prev; nb != &bcache.head && nfree <= reserve; nb = nb->prev){
+    if(nb->refcnt == 0){
+      if(b == 0)
+        b = nb;
+      nfree++;
     }
   }
-  panic("bget: no buffers");
+  if(b && nfree > reserve){
+    b->dev = dev;
+    b->blockno = blockno;
+    b->valid = 0;
+    b->refcnt = 1;
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  release(&bcache.lock);
+  return 0;
+}
+
+// Like bgetreserve(), but there must be a buffer.
+static struct buf*
+bget(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  if((b = bgetreserve(dev, blockno, 0)) == 0)
+    panic("bget: no buffers");
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -102,6 +180,38 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Return locked bufs in b[] with the contents of the first
+// of the n distinct blocks in blocknos[], and of as many of
+// the rest as buffers can be spared for (see BRESERVE).
+// Blocks that are not cached are fetched together with one
+// batched disk request.
+// Returns the number of blocks, at least 1.
+int
+breadn(uint dev, uint *blocknos, int n, struct buf **b)
+{
+  struct buf *miss[NBATCH];
+  int i, got, nmiss;
+
+  if(n > NBATCH)
+    panic("breadn");
+
+  nmiss = 0;
+  for(got = 0; got < n; got++){
+    if(got == 0)
+      b[got] = bget(dev, blocknos[got]);
+    else if((b[got] = bgetreserve(dev, blocknos[got], BRESERVE)) == 0)
+      break;
+    if(!b[got]->valid)
+      miss[nmiss++] = b[got];
+  }
+  if(nmiss > 0){
+    virtio_disk_rwv(miss, nmiss, 0);
+    for(i = 0; i < nmiss; i++)
+      miss[i]->valid = 1;
+  }
+  return got;
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
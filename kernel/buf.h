@@ -7,6 +7,7 @@ struct buf {
   uint refcnt;
   struct buf *prev; // LRU cache list
   struct buf *next;
-  uchar data[BSIZE];
+  uint size;   // block size in bytes
+  uchar *data; // size bytes, in a chunk of bcache's block data
 };
 
@@ -1,17 +1,40 @@
 #include "types.h"
+#include "param.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "slab.h"
 #include "defs.h"
 #include "fs.h"
 
-#define MAX_TREE_NODES 512  // Maximum nodes in Huffman tree
-#define MAX_HEAP_SIZE 256   // Maximum size of priority queue
-#define BITS_PER_BYTE 8
-
-// Global variables
-static struct huffman_node tree[MAX_TREE_NODES];
-static int heap[MAX_HEAP_SIZE];
-static int heap_size = 0;
-static int tree_size = 0;
+// Huffman coding of file contents.
+//
+// The compressed form is the number of tree nodes, the tree
+// (struct huffman_node, root last), then the code bits,
+// most significant bit of each byte first. The tree is built
+// in place in the output and decoded in place in the input,
+// so both must be 4-byte aligned.
+//
+// The working state lives in a context from a slab cache,
+// so several files can be compressed at once.
+
+#define MAX_TREE_NODES 511  // 256 leaves and 255 inner nodes
+#define MAX_CODE_LEN 32
+
+struct hctx {
+    struct huffman_node *tree;
+    int tree_size;
+    int heap[256];
+    int heap_size;
+    int freq[256];
+    uint code[256];             // code of each byte, right-aligned
+    uchar len[256];             // and its length in bits
+};
+
+static struct slabcache hcache;
+
+void compressinit(void) {
+    slabinit(&hcache, "hctx", sizeof(struct hctx), 0);
+}
 
 // Priority queue operations
 static void swap(int *a, int *b) {
@@ -20,80 +43,87 @@ static void swap(int *a, int *b) {
     *b = temp;
 }
 
-void min_heapify(int i) {
+static void min_heapify(struct hctx *h, int i) {
     int smallest = i;
     int left = 2 * i + 1;
     int right = 2 * i + 2;
 
-    if (left < heap_size && tree[heap[left]].freq < tree[heap[smallest]].freq)
+    if (left < h->heap_size && h->tree[h->heap[left]].freq < h->tree[h->heap[smallest]].freq)
         smallest = left;
-    if (right < heap_size && tree[heap[right]].freq < tree[heap[smallest]].freq)
+    if (right < h->heap_size && h->tree[h->heap[right]].freq < h->tree[h->heap[smallest]].freq)
         smallest = right;
 
     if (smallest != i) {
-        swap(&heap[i], &heap[smallest]);
-        min_heapify(smallest);
+        swap(&h->heap[i], &h->heap[smallest]);
+        min_heapify(h, smallest);
     }
 }
 
-void insert_heap(int node_idx) {
-    if (heap_size >= MAX_HEAP_SIZE)
-        return;
+static void insert_heap(struct hctx *h, int node_idx) {
+    h->heap[h->heap_size] = node_idx;
+    int i = h->heap_size++;
 
-    heap[heap_size] = node_idx;
-    int i = heap_size++;
-    
-    while (i > 0 && tree[heap[(i - 1) / 2]].freq > tree[heap[i]].freq) {
-        swap(&heap[i], &heap[(i - 1) / 2]);
+    while (i > 0 && h->tree[h->heap[(i - 1) / 2]].freq > h->tree[h->heap[i]].freq) {
+        swap(&h->heap[i], &h->heap[(i - 1) / 2]);
         i = (i - 1) / 2;
     }
 }
 
-int extract_min() {
-    if (heap_size <= 0)
-        return -1;
-
-    int min = heap[0];
-    heap[0] = heap[--heap_size];
-    min_heapify(0);
+static int extract_min(struct hctx *h) {
+    int min = h->heap[0];
+    h->heap[0] = h->heap[--h->heap_size];
+    min_heapify(h, 0);
     return min;
 }
 
-// Build Huffman tree
-void build_tree(char *input, int inlen) {
-    int freq[256] = {0};
-    tree_size = 0;
-    heap_size = 0;
-
-    // Count frequencies
-    for (int i = 0; i < inlen; i++)
-        freq[(unsigned char)input[i]]++;
+// Build the Huffman tree for input in h->tree.
+static void build_tree(struct hctx *h) {
+    h->tree_size = 0;
+    h->heap_size = 0;
 
     // Create leaf nodes
     for (int i = 0; i < 256; i++) {
-        if (freq[i] > 0) {
-            tree[tree_size].c = i;
-            tree[tree_size].freq = freq[i];
-            tree[tree_size].left = -1;
-            tree[tree_size].right = -1;
-            insert_heap(tree_size++);
+        if (h->freq[i] > 0) {
+            h->tree[h->tree_size].c = i;
+            h->tree[h->tree_size].freq = h->freq[i];
+            h->tree[h->tree_size].left = -1;
+            h->tree[h->tree_size].right = -1;
+            insert_heap(h, h->tree_size++);
         }
     }
 
     // Build tree
-    while (heap_size > 1) {
-        int left = extract_min();
-        int right = extract_min();
-
-        tree[tree_size].freq = tree[left].freq + tree[right].freq;
-        tree[tree_size].left = left;
-        tree[tree_size].right = right;
-        insert_heap(tree_size++);
+    while (h->heap_size > 1) {
+        int left = extract_min(h);
+        int right = extract_min(h);
+
+        h->tree[h->tree_size].c = 0;
+        h->tree[h->tree_size].freq = h->tree[left].freq + h->tree[right].freq;
+        h->tree[h->tree_size].left = left;
+        h->tree[h->tree_size].right = right;
+        insert_heap(h, h->tree_size++);
+    }
+}
+
+// Record the code of each leaf under node.
+// Returns -1 if a code would be too long.
+static int assign_codes(struct hctx *h, int node, uint code, int len) {
+    struct huffman_node *n = &h->tree[node];
+
+    if (n->left == -1) {
+        h->code[n->c] = code;
+        h->len[n->c] = len;
+        return 0;
     }
+    if (len >= MAX_CODE_LEN)
+        return -1;
+    if (assign_codes(h, n->left, code << 1, len + 1) < 0)
+        return -1;
+    return assign_codes(h, n->right, (code << 1) | 1, len + 1);
 }
 
 // Write bit to output buffer
-void write_bit(char *output, int *byte_pos, int *bit_pos, int bit) {
+static void write_bit(char *output, int *byte_pos, int *bit_pos, int bit) {
     if (*bit_pos == 0)
         output[*byte_pos] = 0;
 
@@ -103,64 +133,64 @@ void write_bit(char *output, int *byte_pos, int *bit_pos, int bit) {
         (*byte_pos)++;
 }
 
-// Compress using Huffman coding
+// Compress using Huffman coding.
+// Returns the compressed length, or -1 if it would not be
+// shorter than inlen or fit in maxlen.
 int compress_huffman(char *input, int inlen, char *output, int maxlen) {
-    // Add debug prints
-    printf("Building Huffman tree for %d bytes...\n", inlen);
-    
+    struct hctx *h;
+    int nleaf, byte_pos, bit_pos;
+
     if (!input || !output || inlen <= 0 || maxlen <= 0)
         return -1;
+    if ((h = slaballoc(&hcache)) == 0)
+        return -1;
+
+    memset(h->freq, 0, sizeof(h->freq));
+    nleaf = 0;
+    for (int i = 0; i < inlen; i++)
+        if (h->freq[(unsigned char)input[i]]++ == 0)
+            nleaf++;
+
+    // the tree must fit, leaving room for the code bits.
+    byte_pos = sizeof(int) + sizeof(struct huffman_node) * (2 * nleaf - 1);
+    if (byte_pos >= maxlen || byte_pos >= inlen) {
+        slabfree(&hcache, h);
+        return -1;
+    }
+
+    h->tree = (struct huffman_node *)(output + sizeof(int));
+    build_tree(h);
+    *(int*)output = h->tree_size;
 
-    // Build Huffman tree
-    build_tree(input, inlen);
-    
-    // Write tree size and tree to output
-    if (sizeof(int) + sizeof(struct huffman_node) * tree_size >= maxlen)
+    // a lone symbol still gets a one-bit code.
+    if (assign_codes(h, h->tree_size - 1, 0, nleaf == 1) < 0) {
+        slabfree(&hcache, h);
         return -1;
-    
-    // Write tree size first
-    *(int*)output = tree_size;
-    memmove(output + sizeof(int), tree, sizeof(struct huffman_node) * tree_size);
-    
-    // Compress data
-    int byte_pos = sizeof(int) + sizeof(struct huffman_node) * tree_size;
-    int bit_pos = 0;
-    
+    }
+
+    bit_pos = 0;
     for (int i = 0; i < inlen; i++) {
         unsigned char c = input[i];
-        int curr_node = tree_size - 1;  // Start from root
-        
-        // Find character in tree and write path
-        while (tree[curr_node].left != -1 || tree[curr_node].right != -1) {
-            if (byte_pos >= maxlen)
+        for (int b = h->len[c] - 1; b >= 0; b--) {
+            if (byte_pos >= maxlen || byte_pos >= inlen) {
+                slabfree(&hcache, h);
                 return -1;
-                
-            if (c < tree[tree[curr_node].left].c) {
-                write_bit(output, &byte_pos, &bit_pos, 0);
-                curr_node = tree[curr_node].left;
-            } else {
-                write_bit(output, &byte_pos, &bit_pos, 1);
-                curr_node = tree[curr_node].right;
             }
+            write_bit(output, &byte_pos, &bit_pos, (h->code[c] >> b) & 1);
         }
     }
-    
+    slabfree(&hcache, h);
+
     // Pad last byte if necessary
     if (bit_pos > 0)
         byte_pos++;
-        
-    // Add size checks
-    if(byte_pos >= inlen) {
-        printf("Compression ineffective (got %d bytes)\n", byte_pos);
+    if (byte_pos >= inlen || byte_pos > maxlen)
         return -1;
-    }
-    
-    printf("Compressed to %d bytes\n", byte_pos);
     return byte_pos;
 }
 
 // Read bit from input buffer
-int read_bit(char *input, int *byte_pos, int *bit_pos) {
+static int read_bit(char *input, int *byte_pos, int *bit_pos) {
     int bit = (input[*byte_pos] >> (7 - *bit_pos)) & 1;
     *bit_pos = (*bit_pos + 1) % 8;
     if (*bit_pos == 0)
@@ -168,8 +198,13 @@ int read_bit(char *input, int *byte_pos, int *bit_pos) {
     return bit;
 }
 
-// Decompress using Huffman coding
+// Decompress using Huffman coding, producing at most maxlen
+// bytes. Returns the number of bytes produced, or -1 if the
+// input is not a valid tree.
 int decompress_huffman(char *input, int inlen, char *output, int maxlen) {
+    struct huffman_node *tree;
+    int tree_size, root;
+
     if (!input || !output || inlen <= 0 || maxlen <= 0)
         return -1;
 
@@ -177,33 +212,41 @@ int decompress_huffman(char *input, int inlen, char *output, int maxlen) {
     tree_size = *(int*)input;
     if (tree_size <= 0 || tree_size > MAX_TREE_NODES)
         return -1;
-        
-    // Read tree from input
     if (sizeof(int) + sizeof(struct huffman_node) * tree_size > inlen)
         return -1;
-        
-    memmove(tree, input + sizeof(int), sizeof(struct huffman_node) * tree_size);
-    
+    tree = (struct huffman_node *)(input + sizeof(int));
+    root = tree_size - 1;
+
+    // Inner nodes must point at earlier nodes, so every walk
+    // from the root ends at a leaf.
+    for (int i = 0; i < tree_size; i++) {
+        if (tree[i].left == -1 && tree[i].right == -1)
+            continue;
+        if (tree[i].left < 0 || tree[i].left >= i || tree[i].right < 0 || tree[i].right >= i)
+            return -1;
+    }
+
     // Decompress data
     int in_pos = sizeof(int) + sizeof(struct huffman_node) * tree_size;
     int out_pos = 0;
     int bit_pos = 0;
-    
+
     while (in_pos < inlen && out_pos < maxlen) {
-        int curr_node = tree_size - 1;  // Start from root
-        
+        int curr_node = root;
+
+        if (tree[root].left == -1) {
+            // a lone symbol, coded as one bit.
+            read_bit(input, &in_pos, &bit_pos);
+        }
         // Traverse tree until leaf
-        while (tree[curr_node].left != -1 || tree[curr_node].right != -1) {
+        while (tree[curr_node].left != -1) {
             if (in_pos >= inlen)
-                break;
-                
+                return out_pos;
             int bit = read_bit(input, &in_pos, &bit_pos);
             curr_node = bit ? tree[curr_node].right : tree[curr_node].left;
         }
-        
-        if (tree[curr_node].left == -1 && tree[curr_node].right == -1)
-            output[out_pos++] = tree[curr_node].c;
+        output[out_pos++] = tree[curr_node].c;
     }
-    
+
     return out_pos;
 }
@@ -11,7 +11,9 @@ struct superblock;
 
 // bio.c
 void            binit(void);
+void            bsetsize(uint);
 struct buf*     bread(uint, uint);
+int             breadn(uint, uint*, int, struct buf**);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
@@ -31,14 +33,16 @@ void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
+int             filesplice(struct file*, struct file*, int);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
 
 // fs.c
+extern struct superblock sb;
 void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
-struct inode*   ialloc(uint, short);
+struct inode*   ialloc(uint, short, uint);
 struct inode*   idup(struct inode*);
 void            iinit();
 void            ilock(struct inode*);
@@ -50,8 +54,11 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+int             readpage(struct inode*, uint, char*);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
+int             compressi(struct inode*, int, uint64, uint);
+uint            isize(struct inode*);
 void            itrunc(struct inode*);
 
 // ramdisk.c
@@ -62,6 +69,11 @@ void            ramdiskrw(struct buf*);
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
+void            kref(void *);
+int             korder(uint64);
+void*           kallocpages(int);
+void            kfreepages(void *, int);
+int             krefs(void *);
 void            kinit(void);
 
 // log.c
@@ -70,11 +82,39 @@ void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
 
+// slab.c
+struct slabcache;
+void            slabinit(struct slabcache*, char*, uint, void (*)(void*));
+void*           slaballoc(struct slabcache*);
+void            slabfree(struct slabcache*, void*);
+
+// pcache.c
+void            pcinit(void);
+uint64          pcget(struct inode*, uint64, int);
+uint64          pcwrite(struct inode*, uint64, uint64);
+void            pcput(struct inode*, uint64, char*, int);
+int             pcshared(struct inode*);
+void            pcinval(struct inode*);
+int             pcshrink(int);
+
+// futex.c
+void            futexinit(void);
+int             futexwait(uint64, int);
+int             futexwake(uint64, int);
+
+// swap.c
+void            swapinit(void);
+int             reclaim(int);
+void            swapin(pte_t*, char*);
+pte_t           swapdup(pte_t);
+void            swapfree(pte_t);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
-int             piperead(struct pipe*, uint64, int);
-int             pipewrite(struct pipe*, uint64, int);
+int             piperead(struct pipe*, int, uint64, int);
+int             pipewrite(struct pipe*, int, uint64, int);
 
 // printf.c
 int            printf(char*, ...) __attribute__ ((format (printf, 1, 2)));
@@ -85,23 +125,30 @@ void            printfinit(void);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
-int             growproc(int);
+int             clone(uint64, uint64, uint64, uint64);
+int             join(int, uint64);
+uint64          growproc(int);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
+int             nice(int);
+int             setaffinity(int, uint);
 int             killed(struct proc*);
 void            setkilled(struct proc*);
 struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
 struct proc*    myproc();
+void            tlbshootdown(pagetable_t);
 void            procinit(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
+void            schedtick(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
+int             wakeupn(void*, int);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
@@ -141,11 +188,15 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// timer.c
+void            timersinit(void);
+int             timersleep(uint64);
+void            timerintr(void);
+void            timerslice(void);
+
 // trap.c
-extern uint     ticks;
 void            trapinit(void);
 void            trapinithart(void);
-extern struct spinlock tickslock;
 void            usertrapret(void);
 
 // uart.c
@@ -164,7 +215,18 @@ pagetable_t     uvmcreate(void);
 void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
-int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopy(pagetable_t, pagetable_t, uint64, int);
+int             uvmcow(pagetable_t, uint64);
+uint64          vmfault(pagetable_t, uint64);
+int             uvmmap(pagetable_t, uint64, uint64, int);
+int             uvmallows(pagetable_t, uint64, int);
+uint64          uvmword(pagetable_t, uint64, int*);
+void            uvmtouch(pagetable_t, uint64, uint64);
+struct vma;
+void            vmaput(pagetable_t, struct vma*);
+int             vmacopy(pagetable_t, pagetable_t, struct vma*, int);
+uint64          vmabase(struct proc*);
+int             vmaunmap(uint64, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
@@ -183,11 +245,11 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_rwv(struct buf **, int, int);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
 
 // compress.c
-int             compress_rle(char*, int, char*, int);
-int             decompress_rle(char*, int, char*, int);
+void            compressinit(void);
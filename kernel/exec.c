@@ -26,11 +26,22 @@ exec(char *path, char **argv)
   int i, off;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *xip = 0;
   struct proghdr ph;
+  struct vma vma[NVMA], *v;
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
+  // the other threads would be left without a program.
+  acquire(&p->lock);
+  i = p->leader != p || p->nthread > 0;
+  release(&p->lock);
+  if(i)
+    return -1;
+
+  memset(vma, 0, sizeof(vma));
+  v = vma;
+
   begin_op();
 
   if((ip = namei(path)) == 0){
@@ -49,7 +60,10 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Describe each segment with a vma; vmfault() reads the
+  // pages in as the program touches them. A segment whose
+  // address and file offset differ within a page can't be
+  // mapped from the file's pages, so it is read in now.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -59,17 +73,30 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    if(ph.vaddr % PGSIZE != 0)
-      goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
-      goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(PGROUNDDOWN(ph.vaddr) < PGROUNDUP(sz) || ph.vaddr + ph.memsz >= USERTOP)
       goto bad;
+    if(ph.vaddr % PGSIZE == ph.off % PGSIZE){
+      if(v == &vma[NVMA])
+        goto bad;
+      v->start = PGROUNDDOWN(ph.vaddr);
+      v->end = PGROUNDUP(ph.vaddr + ph.memsz);
+      v->off = PGROUNDDOWN(ph.off);
+      v->filesz = ph.filesz + ph.vaddr % PGSIZE;
+      v->perm = PTE_R|PTE_U|flags2perm(ph.flags);
+      v++;
+      sz = ph.vaddr + ph.memsz;
+    } else {
+      if(uvmalloc(pagetable, PGROUNDDOWN(ph.vaddr), ph.vaddr + ph.memsz, flags2perm(ph.flags)) == 0)
+        goto bad;
+      sz = ph.vaddr + ph.memsz;
+      if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+        goto bad;
+    }
   }
-  iunlockput(ip);
+  // keep a reference to ip for the vmas.
+  iunlock(ip);
   end_op();
+  xip = ip;
   ip = 0;
 
   p = myproc();
@@ -121,11 +148,20 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  vmaput(p->pagetable, p->vma);
+  begin_op();
+  for(v = vma; v < &vma[NVMA] && v->end; v++)
+    v->ip = idup(xip);
+  iput(xip);
+  end_op();
+  memmove(p->vma, vma, sizeof(vma));
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
+  memset(p->tlb, 0, sizeof(p->tlb));
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
+  p->trapframe->tp = 0;  // no thread-local storage yet
   proc_freepagetable(oldpagetable, oldsz);
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
@@ -137,12 +173,17 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  if(xip){
+    begin_op();
+    iput(xip);
+    end_op();
+  }
   return -1;
 }
 
 // Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
+// va need not be page-aligned.
+// The pages from va to va+sz must already be mapped.
 // Returns 0 on success, -1 on failure.
 static int
 loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
@@ -150,17 +191,16 @@ loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz
   uint i, n;
   uint64 pa;
 
-  for(i = 0; i < sz; i += PGSIZE){
+  for(i = 0; i < sz; i += n){
     pa = walkaddr(pagetable, va + i);
     if(pa == 0)
       panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
+    n = PGSIZE - (va + i) % PGSIZE;
+    if(sz - i < n)
       n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
+    if(readi(ip, 0, pa + (va + i) % PGSIZE, offset+i, n) != n)
       return -1;
   }
-  
+
   return 0;
 }
@@ -12,17 +12,19 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "slab.h"
 
 struct devsw devsw[NDEV];
 struct {
-  struct spinlock lock;
-  struct file file[NFILE];
+  struct spinlock lock;      // protects f->ref
+  struct slabcache cache;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  slabinit(&ftable.cache, "file", sizeof(struct file), 0);
 }
 
 // Allocate a file structure.
@@ -31,16 +33,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = slaballoc(&ftable.cache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -69,9 +66,8 @@ fileclose(struct file *f)
     return;
   }
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
   release(&ftable.lock);
+  slabfree(&ftable.cache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -102,9 +98,10 @@ filestat(struct file *f, uint64 addr)
 }
 
 // Read from file f.
-// addr is a user virtual address.
-int
-fileread(struct file *f, uint64 addr, int n)
+// If user_dst==1, then addr is a user virtual address;
+// otherwise, addr is a kernel address.
+static int
+readfile(struct file *f, int user_dst, uint64 addr, int n)
 {
   int r = 0;
 
@@ -112,14 +109,14 @@ fileread(struct file *f, uint64 addr, int n)
     return -1;
 
   if(f->type == FD_PIPE){
-    r = piperead(f->pipe, addr, n);
+    r = piperead(f->pipe, user_dst, addr, n);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
       return -1;
-    r = devsw[f->major].read(1, addr, n);
+    r = devsw[f->major].read(user_dst, addr, n);
   } else if(f->type == FD_INODE){
     ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
+    if((r = readi(f->ip, user_dst, addr, f->off, n)) > 0)
       f->off += r;
     iunlock(f->ip);
   } else {
@@ -130,9 +127,10 @@ fileread(struct file *f, uint64 addr, int n)
 }
 
 // Write to file f.
-// addr is a user virtual address.
-int
-filewrite(struct file *f, uint64 addr, int n)
+// If user_src==1, then addr is a user virtual address;
+// otherwise, addr is a kernel address.
+static int
+writefile(struct file *f, int user_src, uint64 addr, int n)
 {
   int r, ret = 0;
 
@@ -140,11 +138,11 @@ filewrite(struct file *f, uint64 addr, int n)
     return -1;
 
   if(f->type == FD_PIPE){
-    ret = pipewrite(f->pipe, addr, n);
+    ret = pipewrite(f->pipe, user_src, addr, n);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
       return -1;
-    ret = devsw[f->major].write(1, addr, n);
+    ret = devsw[f->major].write(user_src, addr, n);
   } else if(f->type == FD_INODE){
     // write a few blocks at a time to avoid exceeding
     // the maximum log transaction size, including
@@ -152,7 +150,7 @@ filewrite(struct file *f, uint64 addr, int n)
     // and 2 blocks of slop for non-aligned writes.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int max = ((MAXOPBLOCKS-1-1-2) / 2) * sb.bsize;
     int i = 0;
     while(i < n){
       int n1 = n - i;
@@ -161,7 +159,14 @@ filewrite(struct file *f, uint64 addr, int n)
 
       begin_op();
       ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
+      // only a write that is all of the file's new data, in
+      // one transaction, may store it compressed.
+      r = 0;
+      if(n1 == n && f->off == 0)
+        r = compressi(f->ip, user_src, addr, n);
+      if(r == 0)
+        r = writei(f->ip, user_src, addr + i, f->off, n1);
+      if(r > 0)
         f->off += r;
       iunlock(f->ip);
       end_op();
@@ -180,3 +185,98 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+// Read from file f.
+// addr is a user virtual address.
+int
+fileread(struct file *f, uint64 addr, int n)
+{
+  return readfile(f, 1, addr, n);
+}
+
+// Write to file f.
+// addr is a user virtual address.
+int
+filewrite(struct file *f, uint64 addr, int n)
+{
+  return writefile(f, 1, addr, n);
+}
+
+// Move up to n bytes from file in to file out, one of which
+// must be a pipe, without copying them through user memory.
+// A regular file's data goes into a pipe straight from the
+// page cache; anything else goes through a page of kernel
+// memory. Stops early, like read(), once in has no more
+// data for now.
+// Returns the number of bytes moved, or -1.
+int
+filesplice(struct file *in, struct file *out, int n)
+{
+  struct inode *ip;
+  char *buf;
+  uint64 pa;
+  uint off;
+  int m, r, tot;
+
+  if(in->readable == 0 || out->writable == 0 || n < 0)
+    return -1;
+  if(in->type != FD_PIPE && out->type != FD_PIPE)
+    return -1;
+
+  if(in->type == FD_INODE && in->ip->type == T_FILE){
+    ip = in->ip;
+    for(tot = 0; tot < n; tot += r){
+      ilock(ip);
+      off = in->off;
+      m = 0;
+      pa = 0;
+      if(off < isize(ip)){
+        m = ip->lsize - off;
+        if(m > PGSIZE - off % PGSIZE)
+          m = PGSIZE - off % PGSIZE;
+        if(m > n - tot)
+          m = n - tot;
+        pa = pcget(ip, PGROUNDDOWN(off), 0);
+      }
+      iunlock(ip);
+      if(m == 0)
+        break;
+      if(pa == 0)
+        return tot > 0 ? tot : -1;
+      r = pipewrite(out->pipe, 0, pa + off % PGSIZE, m);
+      kfree((void*)pa);
+      if(r < 0)
+        return tot > 0 ? tot : -1;
+      ilock(ip);
+      in->off = off + r;
+      iunlock(ip);
+      if(r < m){
+        tot += r;
+        break;
+      }
+    }
+    return tot;
+  }
+
+  if((buf = kalloc()) == 0)
+    return -1;
+  for(tot = 0; tot < n; tot += m){
+    m = n - tot < PGSIZE ? n - tot : PGSIZE;
+    if((r = readfile(in, 0, (uint64)buf, m)) <= 0){
+      if(r < 0 && tot == 0)
+        tot = -1;
+      break;
+    }
+    if(writefile(out, 0, (uint64)buf, r) != r){
+      if(tot == 0)
+        tot = -1;
+      break;
+    }
+    if(r < m){
+      tot += r;
+      break;
+    }
+  }
+  kfree(buf);
+  return tot;
+}
+
@@ -26,13 +26,18 @@
 // only one device
 struct superblock sb; 
 
+static void imapinit(int dev);
+static int readheader(struct inode*, struct compression_header*);
+
 // Read the super block.
+// The buffer cache starts out with MINBSIZE blocks, so block
+// SBOFF/MINBSIZE holds the super block whatever the block size.
 static void
 readsb(int dev, struct superblock *sb)
 {
   struct buf *bp;
 
-  bp = bread(dev, 1);
+  bp = bread(dev, SBOFF / MINBSIZE);
   memmove(sb, bp->data, sizeof(*sb));
   brelse(bp);
 }
@@ -43,7 +48,11 @@ fsinit(int dev) {
   readsb(dev, &sb);
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
+  if(sb.bsize < MINBSIZE || sb.bsize > MAXBSIZE || (sb.bsize & (sb.bsize - 1)))
+    panic("fsinit: bad block size");
+  bsetsize(sb.bsize);
   initlog(dev, &sb);
+  imapinit(dev);
 }
 
 // Zero a block.
@@ -53,7 +62,7 @@ bzero(int dev, int bno)
   struct buf *bp;
 
   bp = bread(dev, bno);
-  memset(bp->data, 0, BSIZE);
+  memset(bp->data, 0, sb.bsize);
   log_write(bp);
   brelse(bp);
 }
@@ -69,9 +78,9 @@ balloc(uint dev)
   struct buf *bp;
 
   bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
+  for(b = 0; b < sb.size; b += BPB(sb)){
     bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
+    for(bi = 0; bi < BPB(sb) && b + bi < sb.size; bi++){
       m = 1 << (bi % 8);
       if((bp->data[bi/8] & m) == 0){  // Is block free?
         bp->data[bi/8] |= m;  // Mark block in use.
@@ -95,7 +104,7 @@ bfree(int dev, uint b)
   int bi, m;
 
   bp = bread(dev, BBLOCK(b, sb));
-  bi = b % BPB;
+  bi = b % BPB(sb);
   m = 1 << (bi % 8);
   if((bp->data[bi/8] & m) == 0)
     panic("freeing free block");
@@ -164,58 +173,173 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// The inode table is a hash table of entries allocated from
+// kalloc() pages on demand. Each bucket has a spin-lock and a
+// list of its entries, most recently used first. Once NINODE
+// entries exist, iget() recycles the least recently used
+// unreferenced entry in the bucket instead of allocating,
+// and it only runs out of entries if memory runs out.
+//
+// A bucket's lock protects its list and the ref, dev, and inum
+// fields of its entries. Since ip->ref indicates whether an
+// entry is free, and ip->dev and ip->inum indicate which i-node
+// an entry holds, one must hold the bucket lock while using any
+// of those fields. The itable.lock spin-lock protects the pool
+// of unused entries.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
-// dev, and inum.  One must hold ip->lock in order to
+// dev, inum, prev and next.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIBUCKET 13
+#define IHASH(dev, inum) (((dev) * 31 + (inum)) % NIBUCKET)
+
+struct ibucket {
+  struct spinlock lock;
+  struct inode head;
+};
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *free;  // carved from kalloc() pages, not yet used
+  int n;               // number of entries handed out
+  struct ibucket bucket[NIBUCKET];
 } itable;
 
+// The imap bitmap has a bit per i-node, set if the i-node is
+// allocated on disk. It is built by fsinit() and lets ialloc()
+// find a free i-node without reading inode blocks. imap.lock
+// protects it.
+struct {
+  struct spinlock lock;
+  uchar bits[65536/8];  // enough for every ushort dirent inum
+} imap;
+
 void
 iinit()
 {
-  int i = 0;
-  
+  struct ibucket *bkt;
+
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
+  initlock(&imap.lock, "imap");
+  for(bkt = itable.bucket; bkt < itable.bucket+NIBUCKET; bkt++){
+    initlock(&bkt->lock, "itable.bucket");
+    bkt->head.prev = &bkt->head;
+    bkt->head.next = &bkt->head;
   }
 }
 
+// Take an unused inode table entry from the pool, refilling
+// it with a fresh page if it is empty. If spare is set, the
+// caller can recycle an entry instead, so only hand one out
+// while fewer than NINODE exist.
+// Returns 0 if there is no entry to hand out.
+static struct inode*
+inewentry(int spare)
+{
+  struct inode *ip;
+  char *pa;
+
+  acquire(&itable.lock);
+  if(spare && itable.n >= NINODE){
+    release(&itable.lock);
+    return 0;
+  }
+  if(itable.free == 0 && (pa = kalloc()) != 0){
+    for(ip = (struct inode*)pa; ip+1 <= (struct inode*)(pa+PGSIZE); ip++){
+      memset(ip, 0, sizeof(*ip));
+      initsleeplock(&ip->lock, "inode");
+      ip->next = itable.free;
+      itable.free = ip;
+    }
+  }
+  if((ip = itable.free) != 0){
+    itable.free = ip->next;
+    itable.n++;
+  }
+  release(&itable.lock);
+  return ip;
+}
+
 static struct inode* iget(uint dev, uint inum);
 
+// Build the free-inode bitmap from the inode blocks.
+static void
+imapinit(int dev)
+{
+  int inum;
+  struct buf *bp;
+  struct dinode *dip;
+
+  if(sb.ninodes > 8*sizeof(imap.bits))
+    panic("imapinit: too many inodes");
+  bp = 0;
+  for(inum = 0; inum < sb.ninodes; inum++){
+    if(inum == 0 || inum % IPB(sb) == 0){
+      if(bp)
+        brelse(bp);
+      bp = bread(dev, IBLOCK(inum, sb));
+    }
+    dip = (struct dinode*)bp->data + inum%IPB(sb);
+    if(inum == 0 || dip->type != 0)
+      imap.bits[inum/8] |= 1 << (inum%8);
+  }
+  if(bp)
+    brelse(bp);
+}
+
+// Mark a free inode in use in the bitmap and return its number,
+// searching from the start of the inode block holding near.
+// Returns 0 if every inode is in use.
+static uint
+imapalloc(uint near)
+{
+  uint n, inum, start;
+
+  acquire(&imap.lock);
+  start = near < sb.ninodes ? near - near % IPB(sb) : 0;
+  for(n = 0; n < sb.ninodes; n++){
+    inum = (start + n) % sb.ninodes;
+    if(inum % 8 == 0 && imap.bits[inum/8] == 0xff){
+      n += 7;  // skip a byte of in-use inodes
+      continue;
+    }
+    if((imap.bits[inum/8] & (1 << (inum%8))) == 0){
+      imap.bits[inum/8] |= 1 << (inum%8);
+      release(&imap.lock);
+      return inum;
+    }
+  }
+  release(&imap.lock);
+  return 0;
+}
+
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
+// Prefers a free inode in the same inode block as near (e.g.
+// the parent directory), so related inodes share blocks.
 // Returns an unlocked but allocated and referenced inode,
 // or NULL if there is no free inode.
 struct inode*
-ialloc(uint dev, short type)
+ialloc(uint dev, short type, uint near)
 {
-  int inum;
+  uint inum;
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
-    dip = (struct dinode*)bp->data + inum%IPB;
-    if(dip->type == 0){  // a free inode
-      memset(dip, 0, sizeof(*dip));
-      dip->type = type;
-      log_write(bp);   // mark it allocated on the disk
-      brelse(bp);
-      return iget(dev, inum);
-    }
-    brelse(bp);
+  if((inum = imapalloc(near)) == 0){
+    printf("ialloc: no inodes\n");
+    return 0;
   }
-  printf("ialloc: no inodes\n");
-  return 0;
+  bp = bread(dev, IBLOCK(inum, sb));
+  dip = (struct dinode*)bp->data + inum%IPB(sb);
+  if(dip->type != 0)
+    panic("ialloc: inode in use");
+  memset(dip, 0, sizeof(*dip));
+  dip->type = type;
+  log_write(bp);   // mark it allocated on the disk
+  brelse(bp);
+  return iget(dev, inum);
 }
 
 // Copy a modified in-memory inode to disk.
@@ -229,7 +353,7 @@ iupdate(struct inode *ip)
   struct dinode *dip;
 
   bp = bread(ip->dev, IBLOCK(ip->inum, sb));
-  dip = (struct dinode*)bp->data + ip->inum%IPB;
+  dip = (struct dinode*)bp->data + ip->inum%IPB(sb);
   dip->type = ip->type;
   dip->major = ip->major;
   dip->minor = ip->minor;
@@ -246,32 +370,45 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct ibucket *bkt;
+  struct inode *ip, *new;
 
-  acquire(&itable.lock);
+  bkt = &itable.bucket[IHASH(dev, inum)];
+  acquire(&bkt->lock);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+  for(ip = bkt->head.next; ip != &bkt->head; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
       ip->ref++;
-      release(&itable.lock);
+      release(&bkt->lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
+  // Not in the table. Recycle the bucket's least recently
+  // used unreferenced entry if the table is full, or if
+  // there is no memory for a new one.
+  for(ip = bkt->head.prev; ip != &bkt->head; ip = ip->prev)
+    if(ip->ref == 0)
+      break;
+  if((new = inewentry(ip != &bkt->head)) != 0)
+    ip = new;
+  else if(ip == &bkt->head)
     panic("iget: no inodes");
+  else {
+    ip->next->prev = ip->prev;
+    ip->prev->next = ip->next;
+  }
+  ip->next = bkt->head.next;
+  ip->prev = &bkt->head;
+  bkt->head.next->prev = ip;
+  bkt->head.next = ip;
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
-  release(&itable.lock);
+  release(&bkt->lock);
 
   return ip;
 }
@@ -281,9 +418,11 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct ibucket *bkt = &itable.bucket[IHASH(ip->dev, ip->inum)];
+
+  acquire(&bkt->lock);
   ip->ref++;
-  release(&itable.lock);
+  release(&bkt->lock);
   return ip;
 }
 
@@ -302,7 +441,7 @@ ilock(struct inode *ip)
 
   if(ip->valid == 0){
     bp = bread(ip->dev, IBLOCK(ip->inum, sb));
-    dip = (struct dinode*)bp->data + ip->inum%IPB;
+    dip = (struct dinode*)bp->data + ip->inum%IPB(sb);
     ip->type = dip->type;
     ip->major = dip->major;
     ip->minor = dip->minor;
@@ -313,6 +452,8 @@ ilock(struct inode *ip)
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
+    // isize() reads the compression header when it's needed.
+    ip->compressed = -1;
   }
 }
 
@@ -336,7 +477,9 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct ibucket *bkt = &itable.bucket[IHASH(ip->dev, ip->inum)];
+
+  acquire(&bkt->lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
@@ -345,20 +488,33 @@ iput(struct inode *ip)
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&itable.lock);
+    release(&bkt->lock);
 
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
     ip->valid = 0;
 
+    acquire(&imap.lock);
+    imap.bits[ip->inum/8] &= ~(1 << (ip->inum%8));
+    release(&imap.lock);
+
     releasesleep(&ip->lock);
 
-    acquire(&itable.lock);
+    acquire(&bkt->lock);
   }
 
   ip->ref--;
-  release(&itable.lock);
+  if(ip->ref == 0){
+    // no one is using it; move it to the head of the LRU list.
+    ip->next->prev = ip->prev;
+    ip->prev->next = ip->next;
+    ip->next = bkt->head.next;
+    ip->prev = &bkt->head;
+    bkt->head.next->prev = ip;
+    bkt->head.next = ip;
+  }
+  release(&bkt->lock);
 }
 
 // Common idiom: unlock, then put.
@@ -376,54 +532,60 @@ iunlockput(struct inode *ip)
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
 // listed in block ip->addrs[NDIRECT].
 
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
-// returns 0 if out of disk space.
+// Store in addrs[] the disk block addresses of the n blocks
+// of inode ip starting at block bn, reading the indirect block
+// at most once for the whole range. If alloc is set, missing
+// blocks are allocated; otherwise the walk stops at the first
+// block with no address.
+// Returns the number of addresses found, which is less than n
+// only at such a hole or if out of disk space.
 static uint
-bmap(struct inode *ip, uint bn)
+bmaprange(struct inode *ip, uint bn, uint n, uint *addrs, int alloc)
 {
-  uint addr, *a;
+  uint i, addr, *a;
   struct buf *bp;
 
-  if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[bn] = addr;
-    }
-    return addr;
-  }
-  bn -= NDIRECT;
-
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[NDIRECT] = addr;
-    }
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr){
-        a[bn] = addr;
-        log_write(bp);
+  bp = 0;
+  for(i = 0; i < n; i++, bn++){
+    if(bn < NDIRECT){
+      if((addr = ip->addrs[bn]) == 0 && alloc){
+        addr = balloc(ip->dev);
+        ip->addrs[bn] = addr;
+      }
+    } else if(bn - NDIRECT < NINDIRECT(sb)){
+      if(bp == 0){
+        // Load indirect block, allocating if necessary.
+        if((addr = ip->addrs[NDIRECT]) == 0){
+          if(!alloc || (addr = balloc(ip->dev)) == 0)
+            break;
+          ip->addrs[NDIRECT] = addr;
+        }
+        bp = bread(ip->dev, addr);
       }
+      a = (uint*)bp->data;
+      if((addr = a[bn - NDIRECT]) == 0 && alloc){
+        addr = balloc(ip->dev);
+        if(addr){
+          a[bn - NDIRECT] = addr;
+          log_write(bp);
+        }
+      }
+    } else {
+      panic("bmap: out of range");
     }
-    brelse(bp);
-    return addr;
+    if(addr == 0)
+      break;
+    addrs[i] = addr;
   }
-
-  panic("bmap: out of range");
+  if(bp)
+    brelse(bp);
+  return i;
 }
 
-// Truncate inode (discard contents).
+// Free the data blocks listed in ip->addrs[] and zero it.
 // Caller must hold ip->lock.
-void
-itrunc(struct inode *ip)
+static void
+ifreeblocks(struct inode *ip)
 {
   int i, j;
   struct buf *bp;
@@ -439,7 +601,7 @@ itrunc(struct inode *ip)
   if(ip->addrs[NDIRECT]){
     bp = bread(ip->dev, ip->addrs[NDIRECT]);
     a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
+    for(j = 0; j < NINDIRECT(sb); j++){
       if(a[j])
         bfree(ip->dev, a[j]);
     }
@@ -447,8 +609,21 @@ itrunc(struct inode *ip)
     bfree(ip->dev, ip->addrs[NDIRECT]);
     ip->addrs[NDIRECT] = 0;
   }
+}
+
+// Truncate inode (discard contents).
+// Caller must hold ip->lock.
+void
+itrunc(struct inode *ip)
+{
+  pcinval(ip);
+  if(ip->type == T_FILE && ip->size <= INLINESIZE)
+    memset(ip->addrs, 0, sizeof(ip->addrs));
+  else
+    ifreeblocks(ip);
 
-  ip->size = 0;
+  ip->size = ip->lsize = 0;
+  ip->compressed = 0;
   iupdate(ip);
 }
 
@@ -461,113 +636,385 @@ stati(struct inode *ip, struct stat *st)
   st->ino = ip->inum;
   st->type = ip->type;
   st->nlink = ip->nlink;
-  st->size = ip->size;
+  st->size = isize(ip);
+}
+
+// Copy n bytes of ip's blocks, starting at byte off, to dst.
+// Works through the range up to NBATCH blocks at a time: one
+// bmaprange() walk and one batched disk read per group,
+// smaller when buffers are short (see breadn()).
+// Caller must hold ip->lock.
+// Returns the number of bytes copied, or -1 if a copy failed.
+static int
+readblocks(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
+{
+  uint tot, m, nb, i;
+  uint addrs[NBATCH];
+  struct buf *bufs[NBATCH];
+
+  tot = 0;
+  while(tot < n){
+    nb = (off + (n - tot) - 1) / sb.bsize - off / sb.bsize + 1;
+    if(nb > NBATCH)
+      nb = NBATCH;
+    if((nb = bmaprange(ip, off / sb.bsize, nb, addrs, 0)) == 0)
+      break;
+    nb = breadn(ip->dev, addrs, nb, bufs);
+    for(i = 0; i < nb; i++){
+      m = min(n - tot, sb.bsize - off % sb.bsize);
+      if(either_copyout(user_dst, dst, bufs[i]->data + (off % sb.bsize), m) == -1){
+        for(; i < nb; i++)
+          brelse(bufs[i]);
+        return -1;
+      }
+      brelse(bufs[i]);
+      tot += m;
+      off += m;
+      dst += m;
+    }
+  }
+  return tot;
+}
+
+// Copy n bytes from src into ip's blocks, starting at byte off,
+// allocating blocks as needed. Like readblocks(), resolves and
+// reads up to NBATCH blocks per pass.
+// Caller must hold ip->lock and be inside a transaction.
+// Returns the number of bytes copied, which is short of n if
+// the disk filled up or a copy failed. Does not update ip->size.
+static int
+writeblocks(struct inode *ip, int user_src, uint64 src, uint off, uint n)
+{
+  uint tot, m, nb, i;
+  uint addrs[NBATCH];
+  struct buf *bufs[NBATCH];
+
+  tot = 0;
+  while(tot < n){
+    nb = (off + (n - tot) - 1) / sb.bsize - off / sb.bsize + 1;
+    if(nb > NBATCH)
+      nb = NBATCH;
+    if((nb = bmaprange(ip, off / sb.bsize, nb, addrs, 1)) == 0)
+      break;
+    nb = breadn(ip->dev, addrs, nb, bufs);
+    for(i = 0; i < nb; i++){
+      m = min(n - tot, sb.bsize - off % sb.bsize);
+      if(either_copyin(bufs[i]->data + (off % sb.bsize), user_src, src, m) == -1){
+        for(; i < nb; i++)
+          brelse(bufs[i]);
+        return tot;
+      }
+      log_write(bufs[i]);
+      brelse(bufs[i]);
+      tot += m;
+      off += m;
+      src += m;
+    }
+  }
+  return tot;
+}
+
+// Like readblocks(), but reads the data of a small file
+// from the inode itself.
+static int
+readdata(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
+{
+  if(ip->type == T_FILE && ip->size <= INLINESIZE){
+    if(either_copyout(user_dst, dst, (char*)ip->addrs + off, n) == -1)
+      return -1;
+    return n;
+  }
+  return readblocks(ip, user_dst, dst, off, n);
+}
+
+// Like writeblocks(), but keeps the data of a file that still
+// fits in INLINESIZE bytes in the inode, moving it out to a
+// block once the file grows past that. The caller must update
+// ip->size and call iupdate().
+static int
+writedata(struct inode *ip, int user_src, uint64 src, uint off, uint n)
+{
+  char tmp[INLINESIZE];
+  uint size, tot;
+
+  size = ip->size;
+  if(ip->type != T_FILE || size > INLINESIZE)
+    return writeblocks(ip, user_src, src, off, n);
+
+  if(off + n <= INLINESIZE){
+    if(either_copyin((char*)ip->addrs + off, user_src, src, n) == -1)
+      return 0;
+    return n;
+  }
+
+  // Growing out of the inode: move the inline data to a block.
+  memmove(tmp, ip->addrs, size);
+  memset(ip->addrs, 0, sizeof(ip->addrs));
+  if(writeblocks(ip, 0, (uint64)tmp, 0, size) != size){
+    ifreeblocks(ip);
+    memmove(ip->addrs, tmp, size);
+    return 0;
+  }
+  tot = writeblocks(ip, user_src, src, off, n);
+  if(off + tot <= INLINESIZE){
+    // The write fell short and the file still fits: move it back.
+    if(off + tot > size)
+      size = off + tot;
+    readblocks(ip, 0, (uint64)tmp, 0, size);
+    ifreeblocks(ip);
+    memmove(ip->addrs, tmp, size);
+  }
+  return tot;
+}
+
+// Read the compression header of file ip into ch.
+// Returns 1 if ip's data is compressed, else 0.
+// Caller must hold ip->lock.
+static int
+readheader(struct inode *ip, struct compression_header *ch)
+{
+  if(ip->type != T_FILE || ip->size < sizeof(*ch))
+    return 0;
+  if(readdata(ip, 0, (uint64)ch, 0, sizeof(*ch)) != sizeof(*ch))
+    return 0;
+  return ch->magic == COMPRESSION_MAGIC && ch->compressed == 1;
+}
+
+// Return the size of file ip's data, once decompressed.
+// Reads the compression header the first time, rather than
+// in ilock(), which would cost a disk read for every inode.
+// Caller must hold ip->lock.
+uint
+isize(struct inode *ip)
+{
+  struct compression_header ch;
+
+  if(ip->compressed < 0){
+    ip->compressed = readheader(ip, &ch);
+    ip->lsize = ip->compressed ? ch.length : ip->size;
+  }
+  return ip->lsize;
+}
+
+// Decompress all of compressed file ip, whose header is
+// ch, into a new block from kallocpages(korder(ch->length)).
+// Returns the block, or 0.
+// Caller must hold ip->lock.
+static char*
+decompressi(struct inode *ip, struct compression_header *ch)
+{
+    int comp_size = ip->size - sizeof(*ch);
+    int comp_order = korder(comp_size);
+    int order = korder(ch->length);
+    char *comp_buf = kallocpages(comp_order);
+    char *buf = kallocpages(order);
+
+    if (!comp_buf || !buf)
+        goto bad;
+    // Read compressed data (skipping header)
+    if (readdata(ip, 0, (uint64)comp_buf, sizeof(*ch), comp_size) != comp_size)
+        goto bad;
+    if (decompress_huffman(comp_buf, comp_size, buf, ch->length) != ch->length)
+        goto bad;
+    kfreepages(comp_buf, comp_order);
+    return buf;
+
+bad:
+    if (comp_buf) kfreepages(comp_buf, comp_order);
+    if (buf) kfreepages(buf, order);
+    return 0;
+}
+
+// Read the page of file ip's data from byte off (page-aligned)
+// into mem, decompressing it if need be. This is how the page
+// cache reads files; see pcget(). A compressed file is
+// decompressed whole, so its other pages go into the cache
+// too: those before off first, then the rest from the end
+// back, so that the pages after off are the last to be
+// recycled.
+// Returns the number of bytes read, less than PGSIZE at the
+// end of the file, or -1.
+// Caller must hold ip->lock.
+int
+readpage(struct inode *ip, uint off, char *mem)
+{
+    struct compression_header ch;
+    char *buf;
+    uint n, o;
+
+    if (off >= isize(ip))
+        return 0;
+    n = min(ip->lsize - off, PGSIZE);
+    if (!ip->compressed || !readheader(ip, &ch))
+        return readdata(ip, 0, (uint64)mem, off, n);
+
+    if ((buf = decompressi(ip, &ch)) == 0)
+        return -1;
+    memmove(mem, buf + off, n);
+    for (o = 0; o < off; o += PGSIZE)
+        pcput(ip, o, buf + o, PGSIZE);
+    for (o = PGROUNDDOWN(ch.length - 1); o > off; o -= PGSIZE)
+        pcput(ip, o, buf + o, min(ch.length - o, PGSIZE));
+    kfreepages(buf, korder(ch.length));
+    return n;
 }
 
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
+// File data comes a page at a time from the page cache,
+// decompressed if the file is compressed.
 int readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n) {
+    uint64 pa;
     uint tot, m;
-    struct buf *bp;
-    static char *cached_decomp_buf = 0;  // Static buffer to cache decompressed data
-    static int cached_inum = 0;          // Cache the inode number
-    static int cached_length = 0;        // Cache the original length
 
-    if (off > ip->size || off + n < off)
+    if (off > isize(ip) || off + n < off)
         return 0;
-    if (off + n > ip->size)
-        n = ip->size - off;
-
-    // Check for compression
-    if (ip->type == T_FILE) {
-        // Read first block to check compression header
-        bp = bread(ip->dev, bmap(ip, 0));
-        struct compression_header ch;
-        memmove(&ch, bp->data, sizeof(ch));
-        brelse(bp);
+    if (off + n > ip->lsize)
+        n = ip->lsize - off;
+    if (ip->type != T_FILE)
+        return readdata(ip, user_dst, dst, off, n);
+
+    for (tot = 0; tot < n; tot += m, off += m, dst += m) {
+        m = min(n - tot, PGSIZE - off % PGSIZE);
+        if ((pa = pcget(ip, PGROUNDDOWN(off), 0)) == 0)
+            return -1;
+        if (either_copyout(user_dst, dst, (char*)pa + off % PGSIZE, m) == -1) {
+            kfree((void*)pa);
+            return -1;
+        }
+        kfree((void*)pa);
+    }
+    return tot;
+}
 
-        if (ch.compressed == 1) {
-            printf("readi: found compressed file, original length %d\n", ch.length);
-            
-            // Check if we need to decompress (not cached or different file)
-            if (cached_decomp_buf == 0 || cached_inum != ip->inum) {
-                // Free old cache if it exists
-                if (cached_decomp_buf) {
-                    kfree(cached_decomp_buf);
-                    cached_decomp_buf = 0;
-                }
-                
-                // Allocate buffers
-                char *comp_buf = kalloc();
-                cached_decomp_buf = kalloc();
-                
-                if (!comp_buf || !cached_decomp_buf) {
-                    if (comp_buf) kfree(comp_buf);
-                    if (cached_decomp_buf) cached_decomp_buf = 0;
-                    return -1;
-                }
-
-                // Read compressed data (skipping header)
-                int comp_size = ip->size - sizeof(ch);
-                tot = 0;
-                while (tot < comp_size) {
-                    bp = bread(ip->dev, bmap(ip, (tot + sizeof(ch)) / BSIZE));
-                    m = min(comp_size - tot, BSIZE - ((tot + sizeof(ch)) % BSIZE));
-                    memmove(comp_buf + tot, bp->data + ((tot + sizeof(ch)) % BSIZE), m);
-                    brelse(bp);
-                    tot += m;
-                }
-
-                // Decompress
-                int decomp_size = decompress_huffman(comp_buf, comp_size, cached_decomp_buf, ch.length);
-                kfree(comp_buf);
-                
-                if (decomp_size < 0) {
-                    kfree(cached_decomp_buf);
-                    cached_decomp_buf = 0;
-                    return -1;
-                }
-
-                cached_inum = ip->inum;
-                cached_length = ch.length;
-            }
+// Store compressed file ip plainly, before a write that
+// replaces only part of it.
+// Returns 0, or -1 if out of memory.
+// Caller must hold ip->lock.
+static int
+expandi(struct inode *ip)
+{
+    struct compression_header ch;
+    char *buf;
+    uint len;
 
-            // Validate offset and length
-            if (off >= cached_length) {
-                return 0;
-            }
+    if (!readheader(ip, &ch))
+        return 0;
+    if ((buf = decompressi(ip, &ch)) == 0)
+        return -1;
+    len = ch.length;
+    itrunc(ip);
+    if (writedata(ip, 0, (uint64)buf, 0, len) != len) {
+        kfreepages(buf, korder(len));
+        return -1;
+    }
+    ip->size = ip->lsize = len;
+    ip->compressed = 0;
+    iupdate(ip);
+    kfreepages(buf, korder(len));
+    return 0;
+}
 
-            // Adjust n if it would read past end of original file
-            if (off + n > cached_length) {
-                n = cached_length - off;
+// Write n bytes of file ip's data at off, a page at a time,
+// through the page cache: a cached page gets the new data,
+// then goes to the disk (through the log) from there.
+// Returns the number of bytes written.
+// Caller must hold ip->lock and update ip->size.
+static int
+writecached(struct inode *ip, int user_src, uint64 src, uint off, uint n)
+{
+    uint64 pa;
+    uint tot, m;
+    char *p;
+
+    for (tot = 0; tot < n; tot += m, off += m, src += m) {
+        m = min(n - tot, PGSIZE - off % PGSIZE);
+        pa = pcwrite(ip, PGROUNDDOWN(off), user_src ? 0 : PGROUNDDOWN(src));
+        if (pa == 0) {
+            if (writedata(ip, user_src, src, off, m) != m)
+                break;
+        } else {
+            // vmawrite() writes a cached page back from itself.
+            p = (char*)pa + off % PGSIZE;
+            if ((uint64)p != src && either_copyin(p, user_src, src, m) == -1) {
+                kfree((void*)pa);
+                pcinval(ip);
+                break;
             }
-
-            // Copy requested portion to user
-            if (either_copyout(user_dst, dst, cached_decomp_buf + off, n) == -1) {
-                return -1;
+            if (writedata(ip, 0, (uint64)p, off, m) != m) {
+                kfree((void*)pa);
+                pcinval(ip);
+                break;
             }
-
-            return n;
-        }
-    }
-
-    // Regular uncompressed read
-    for(tot = 0; tot < n; tot += m, off += m, dst += m) {
-        bp = bread(ip->dev, bmap(ip, off / BSIZE));
-        m = min(n - tot, BSIZE - off % BSIZE);
-        if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
-            brelse(bp);
-            return -1;
+            kfree((void*)pa);
         }
-        brelse(bp);
+        // writedata() needs the size so far.
+        if (off + m > ip->size)
+            ip->size = off + m;
     }
-    
     return tot;
 }
 
+// Replace all of file ip's data with the n bytes at src,
+// stored compressed. For a write that is a file's whole new
+// contents and fits one log transaction; see filewrite().
+// Returns n, 0 if ip was left alone because compression
+// doesn't apply or saves no space, or -1.
+// Caller must hold ip->lock.
+int compressi(struct inode *ip, int user_src, uint64 src, uint n) {
+    struct compression_header ch;
+    int order = korder(n);
+    char *temp_buf, *comp_buf;
+    int comp_size, r = 0;
+
+    // A file that MAP_SHARED regions map keeps its pages, and
+    // is not compressed (which would drop them).
+    if(ip->type != T_FILE || n <= sizeof(ch) || n < isize(ip) ||
+       order > MAXORDER || pcshared(ip))
+        return 0;
+    if((temp_buf = kallocpages(order)) == 0)
+        return 0;
+    if((comp_buf = kallocpages(order)) == 0) {
+        kfreepages(temp_buf, order);
+        return 0;
+    }
+    if(either_copyin(temp_buf, user_src, src, n) == -1) {
+        r = -1;
+        goto out;
+    }
+
+    comp_size = compress_huffman(temp_buf, n, comp_buf + sizeof(ch),
+                                 (PGSIZE << order) - sizeof(ch));
+    // Use compression if it saves space
+    if(comp_size <= 0 || comp_size + sizeof(ch) >= n)
+        goto out;
 
+    ch.magic = COMPRESSION_MAGIC;
+    ch.compressed = 1;
+    ch.length = n;
+    ch.tree_size = comp_size;
+    memmove(comp_buf, &ch, sizeof(ch));
+
+    // The compressed file replaces the old contents; drop
+    // them first, so that a small result can be stored inline.
+    itrunc(ip);
+    if(writedata(ip, 0, (uint64)comp_buf, 0, sizeof(ch) + comp_size) != sizeof(ch) + comp_size) {
+        r = -1;
+        goto out;
+    }
+    ip->size = comp_size + sizeof(ch);
+    ip->lsize = n;
+    ip->compressed = 1;
+    iupdate(ip);
+    r = n;
+
+out:
+    kfreepages(temp_buf, order);
+    kfreepages(comp_buf, order);
+    return r;
+}
 
 // Write data to inode.
 // Caller must hold ip->lock.
@@ -577,84 +1024,28 @@ int readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n) {
 // If the return value is less than the requested n,
 // there was an error of some kind.
 int writei(struct inode *ip, int user_src, uint64 src, uint off, uint n) {
-    uint tot, m;
-    struct buf *bp;
+    uint tot;
 
-    if(off > ip->size || off + n < off)
+    if(off > isize(ip) || off + n < off)
         return -1;
-    if(off + n > MAXFILE * BSIZE)
+    if(off + n > MAXFILE(sb) * sb.bsize)
         return -1;
 
-    // Only try compression for regular files and writing from start
-    if(ip->type == T_FILE && off == 0) {
-        char *temp_buf = kalloc();
-        if(!temp_buf)
-            return -1;
-
-        // Copy data to temporary buffer
-        if(either_copyin(temp_buf, user_src, src, n) == -1) {
-            kfree(temp_buf);
+    if(ip->type == T_FILE) {
+        // A compressed file that the write replaces is dropped;
+        // one that it changes only part of is stored plainly first.
+        if(ip->compressed && off == 0 && n >= ip->lsize)
+            itrunc(ip);
+        else if(ip->compressed && expandi(ip) < 0)
             return -1;
-        }
-
-        // Try compression if file is larger than minimum size
-        if(n > sizeof(struct compression_header)) {
-            char *comp_buf = kalloc();
-            if(comp_buf) {
-                printf("Attempting compression of %d bytes...\n", n);
-                
-                // Attempt compression
-                int comp_size = compress_huffman(temp_buf, n, comp_buf, PGSIZE);
-                printf("Compression result: %d bytes\n", comp_size);
-                
-                // Use compression if it saves space
-                if(comp_size > 0 && comp_size < n) {
-                    printf("Using compressed data (saved %d bytes)\n", n - comp_size);
-                    
-                    struct compression_header ch;
-                    ch.magic = COMPRESSION_MAGIC;
-                    ch.compressed = 1;
-                    ch.length = n;
-                    ch.tree_size = comp_size;
-
-                    // Write header and compressed data
-                    bp = bread(ip->dev, bmap(ip, 0));
-                    if(bp) {
-                        memmove(bp->data, &ch, sizeof(ch));
-                        memmove(bp->data + sizeof(ch), comp_buf, comp_size);
-                        log_write(bp);
-                        brelse(bp);
-                        
-                        ip->size = comp_size + sizeof(ch);
-                        iupdate(ip);
-                        
-                        kfree(temp_buf);
-                        kfree(comp_buf);
-                        return n;  // Return original size
-                    }
-                } else {
-                    printf("Compression not beneficial, using original data\n");
-                }
-                kfree(comp_buf);
-            }
-        }
-        kfree(temp_buf);
-    }
-
-    // Regular uncompressed write for non-regular files or non-start writes
-    for(tot = 0; tot < n; tot += m, off += m, src += m) {
-        bp = bread(ip->dev, bmap(ip, off / BSIZE));
-        m = min(n - tot, BSIZE - off % BSIZE);
-        if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
-            brelse(bp);
-            break;
-        }
-        log_write(bp);
-        brelse(bp);
+        tot = writecached(ip, user_src, src, off, n);
+    } else {
+        tot = writedata(ip, user_src, src, off, n);
     }
 
-    if(off > ip->size)
-        ip->size = off;
+    if(off + tot > ip->size)
+        ip->size = off + tot;
+    ip->lsize = ip->size;
 
     iupdate(ip);
     return tot;
@@ -779,7 +1170,7 @@ namex(char *path, int nameiparent, char *name)
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
   else
-    ip = idup(myproc()->cwd);
+    ip = idup(myproc()->leader->cwd);
 
   while((path = skipelem(path, name)) != 0){
     ilock(ip);
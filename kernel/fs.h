@@ -3,12 +3,20 @@
 
 
 #define ROOTINO  1   // root i-number
-#define BSIZE 1024  // block size
+#define BSIZE 1024  // default block size
+#define MINBSIZE 1024   // smallest supported block size
+#define MAXBSIZE 65536  // largest supported block size
+#define SBOFF 1024  // byte offset of the super block on disk
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
 //                                          free bit map | data blocks]
 //
+// The super block always starts SBOFF bytes into the disk, so it
+// can be found before the block size is known. With 1024-byte
+// blocks it is block 1; with larger blocks it shares block 0 with
+// the boot area and the log starts at block 1.
+//
 // mkfs computes the super block and builds an initial file system. The
 // super block describes the disk layout:
 struct superblock {
@@ -20,13 +28,18 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint bsize;        // Block size (bytes)
 };
 
 #define FSMAGIC 0x10203040
 
 #define NDIRECT 12
-#define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NINDIRECT(sb) ((sb).bsize / sizeof(uint))
+#define MAXFILE(sb) (NDIRECT + NINDIRECT(sb))
+
+// A T_FILE whose size is at most INLINESIZE keeps its data in
+// the inode's addrs[] rather than in data blocks.
+#define INLINESIZE ((NDIRECT+1) * sizeof(uint))
 
 // On-disk inode structure
 struct dinode {
@@ -39,16 +52,16 @@ struct dinode {
 };
 
 // Inodes per block.
-#define IPB           (BSIZE / sizeof(struct dinode))
+#define IPB(sb)       ((sb).bsize / sizeof(struct dinode))
 
 // Block containing inode i
-#define IBLOCK(i, sb)     ((i) / IPB + sb.inodestart)
+#define IBLOCK(i, sb)     ((i) / IPB(sb) + (sb).inodestart)
 
 // Bitmap bits per block
-#define BPB           (BSIZE*8)
+#define BPB(sb)       ((sb).bsize*8)
 
 // Block of free map containing bit for block b
-#define BBLOCK(b, sb) ((b)/BPB + sb.bmapstart)
+#define BBLOCK(b, sb) ((b)/BPB(sb) + (sb).bmapstart)
 
 // Directory is a file containing a sequence of dirent structures.
 #define DIRSIZ 14
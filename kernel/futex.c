@@ -0,0 +1,107 @@
+// Futexes: sleeping on a word of user memory.
+//
+// futexwait() sleeps while a user word holds an expected
+// value, and futexwake() wakes processes sleeping on a word,
+// so user code can build locks and queues that only enter
+// the kernel when they have to wait. A word in a MAP_SHARED
+// region is known by its physical address, so processes
+// that share the page meet on the same word wherever they
+// map it. Any other word is known by its process and
+// address, since copy-on-write, or fork() copying pages for
+// a process with threads, may move it to another page.
+//
+// futex.lock is held from reading the word to sleep(), so a
+// wake can't slip in between the check and the sleep. The
+// word is read with the page table's lock held too (see
+// uvmword()), so that another thread can't replace its page
+// meanwhile.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fcntl.h"
+#include "defs.h"
+
+// wait channel of a private word: above every user address,
+// and every physical one, so it can't be mistaken for either.
+#define PRIVKEY(lp, addr) ((void*)(((uint64)((lp) - proc) + 1) * MAXVA + (addr)))
+
+extern struct proc proc[NPROC];
+
+struct {
+  struct spinlock lock;
+} futex;
+
+void
+futexinit(void)
+{
+  initlock(&futex.lock, "futex");
+}
+
+// Read the calling process's word at addr into *val, first
+// faulting its page in if need be, and return the wait
+// channel for it, with futex.lock held, or 0.
+static void*
+futexlock(uint64 addr, int *val)
+{
+  struct proc *lp = myproc()->leader;
+  pagetable_t pagetable = lp->pagetable;
+  struct vma *v;
+  uint64 pa;
+
+  if(addr % sizeof(int) != 0 || addr >= MAXVA)
+    return 0;
+  uvmtouch(pagetable, addr, sizeof(int));
+  for(;;){
+    acquire(&futex.lock);
+    if((pa = uvmword(pagetable, addr, val)) != 0)
+      break;
+    release(&futex.lock);
+    if(vmfault(pagetable, addr) == 0 && !uvmallows(pagetable, addr, PTE_R))
+      return 0;
+  }
+  for(v = lp->vma; v < &lp->vma[NVMA]; v++)
+    if(v->end && addr >= v->start && addr < v->end && v->flags == MAP_SHARED)
+      return (void*)pa;
+  return PRIVKEY(lp, addr);
+}
+
+// Sleep until woken by futexwake(), if the word at addr
+// holds val. Returns 0 once woken, or -1 if the word held
+// something else or the process was killed; wakeups may
+// be spurious, so callers check the word again.
+int
+futexwait(uint64 addr, int val)
+{
+  struct proc *p = myproc();
+  void *chan;
+  int cur;
+
+  if((chan = futexlock(addr, &cur)) == 0)
+    return -1;
+  if(cur != val){
+    release(&futex.lock);
+    return -1;
+  }
+  sleep(chan, &futex.lock);
+  release(&futex.lock);
+  return killed(p) ? -1 : 0;
+}
+
+// Wake up to n processes waiting on the word at addr.
+// Returns the number woken, or -1.
+int
+futexwake(uint64 addr, int n)
+{
+  void *chan;
+  int cur, woken;
+
+  if((chan = futexlock(addr, &cur)) == 0)
+    return -1;
+  woken = wakeupn(chan, n);
+  release(&futex.lock);
+  return woken;
+}
@@ -1,6 +1,20 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or physically contiguous blocks of 2^order pages.
+//
+// Underneath is a buddy allocator: a free block of 2^k pages
+// starts at a page number (counting from KERNBASE) that is a
+// multiple of 2^k, and is merged with its buddy, the other
+// half of the 2^(k+1) block, when both are free.
+//
+// Single pages go through per-cpu free lists on top of it. A
+// cpu whose list is empty takes a batch of pages from the
+// buddy allocator, or failing that from the cpu with the
+// most; a cpu with too many gives a batch back.
+//
+// Each page has a reference count so that fork can share
+// pages copy-on-write; kfree() frees on the last reference.
 
 #include "types.h"
 #include "param.h"
@@ -16,17 +30,42 @@ extern char end[]; // first address after kernel.
 
 struct run {
   struct run *next;
+  struct run *prev;  // buddy free lists only
 };
 
+#define NPAGE ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PA2PG(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define PG2PA(pg) (KERNBASE + (uint64)(pg) * PGSIZE)
+#define FREEBLOCK 0x80  // in border[]: first page of a free block
+
 struct {
+  struct spinlock lock;
+  struct run *free[MAXORDER+1];
+} buddy;
+
+// For the first page of each free buddy block, its order
+// with FREEBLOCK set; 0 for all other pages.
+static uchar border[NPAGE];
+
+struct kmem {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;
+} kmem[NCPU];
+
+// References to each physical page, updated atomically.
+static int refcnt[NPAGE];
+
+static void bfree(uint64, int);
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  struct kmem *km;
+
+  for(km = kmem; km < &kmem[NCPU]; km++)
+    initlock(&km->lock, "kmem");
+  initlock(&buddy.lock, "buddy");
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -35,48 +74,281 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
+  acquire(&buddy.lock);
   for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+    bfree((uint64)p, 0);
+  release(&buddy.lock);
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+static void
+blink(int k, struct run *r)
+{
+  r->prev = 0;
+  r->next = buddy.free[k];
+  if(r->next)
+    r->next->prev = r;
+  buddy.free[k] = r;
+}
+
+static void
+bunlink(int k, struct run *r)
+{
+  if(r->prev)
+    r->prev->next = r->next;
+  else
+    buddy.free[k] = r->next;
+  if(r->next)
+    r->next->prev = r->prev;
+}
+
+// Free the block of 2^k pages at pa, merging it with its
+// buddy as long as the buddy is free too.
+// Caller must hold buddy.lock.
+static void
+bfree(uint64 pa, int k)
+{
+  uint64 pg, b;
+
+  pg = PA2PG(pa);
+  for(; k < MAXORDER; k++){
+    b = pg ^ (1L << k);
+    if(b >= NPAGE || border[b] != (k | FREEBLOCK))
+      break;
+    bunlink(k, (struct run*)PG2PA(b));
+    border[b] = 0;
+    pg &= ~(1L << k);
+  }
+  border[pg] = k | FREEBLOCK;
+  blink(k, (struct run*)PG2PA(pg));
+}
+
+// Take a block of 2^k pages, splitting a larger one if
+// need be. Returns 0 if there is none.
+// Caller must hold buddy.lock.
+static uint64
+balloc(int k)
+{
+  struct run *r;
+  uint64 pg;
+  int j;
+
+  for(j = k; j <= MAXORDER && buddy.free[j] == 0; j++)
+    ;
+  if(j > MAXORDER)
+    return 0;
+  r = buddy.free[j];
+  bunlink(j, r);
+  pg = PA2PG(r);
+  border[pg] = 0;
+  // give back the upper halves.
+  while(j > k){
+    j--;
+    border[pg + (1L << j)] = j | FREEBLOCK;
+    blink(j, (struct run*)PG2PA(pg + (1L << j)));
+  }
+  return (uint64)r;
+}
+
+// Drop a reference to the page of physical memory pointed
+// at by pa, which normally should have been returned by a
+// call to kalloc(), and free it if that was the last.
+// (The exception is when initializing the allocator;
+// see kinit above.)
 void
 kfree(void *pa)
 {
   struct run *r;
+  struct kmem *km;
+  int n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  if((n = __sync_sub_and_fetch(&refcnt[PA2PG(pa)], 1)) > 0)
+    return;
+  if(n < 0)
+    panic("kfree: ref");
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  km = &kmem[cpuid()];
+  acquire(&km->lock);
+  r->next = km->freelist;
+  km->freelist = r;
+  if(++km->nfree > 2*KBATCH){
+    // give a batch back, so that it can merge into blocks.
+    acquire(&buddy.lock);
+    for(n = 0; n < KBATCH; n++){
+      r = km->freelist;
+      km->freelist = r->next;
+      bfree((uint64)r, 0);
+    }
+    release(&buddy.lock);
+    km->nfree -= KBATCH;
+  }
+  release(&km->lock);
+  pop_off();
+}
+
+// Move up to KBATCH pages, at most half of its free list,
+// from the cpu with the most free pages to km.
+static void
+ksteal(struct kmem *km)
+{
+  struct kmem *v, *victim;
+  struct run *first, *last;
+  int n;
+
+  victim = 0;
+  for(v = kmem; v < &kmem[NCPU]; v++){
+    // nfree is only a hint here.
+    if(v != km && v->nfree > 0 && (victim == 0 || v->nfree > victim->nfree))
+      victim = v;
+  }
+  if(victim == 0)
+    return;
+
+  acquire(&victim->lock);
+  first = last = victim->freelist;
+  n = 0;
+  if(first){
+    for(n = 1; n < KBATCH && n < (victim->nfree+1)/2 && last->next; n++)
+      last = last->next;
+    victim->freelist = last->next;
+    victim->nfree -= n;
+  }
+  release(&victim->lock);
+  if(n == 0)
+    return;
+
+  acquire(&km->lock);
+  last->next = km->freelist;
+  km->freelist = first;
+  km->nfree += n;
+  release(&km->lock);
+}
+
+// Take a page from this cpu's free list, refilling it from
+// the buddy allocator or another cpu if need be.
+static struct run*
+kget(void)
+{
+  struct run *r;
+  struct kmem *km;
+
+  push_off();
+  km = &kmem[cpuid()];
+  acquire(&km->lock);
+  if(km->freelist == 0){
+    acquire(&buddy.lock);
+    while(km->nfree < KBATCH && (r = (struct run*)balloc(0)) != 0){
+      r->next = km->freelist;
+      km->freelist = r;
+      km->nfree++;
+    }
+    release(&buddy.lock);
+  }
+  release(&km->lock);
+  if(km->freelist == 0)
+    ksteal(km);
+  acquire(&km->lock);
+  r = km->freelist;
+  if(r){
+    km->freelist = r->next;
+    km->nfree--;
+  }
+  release(&km->lock);
+  pop_off();
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
+// When there is none free, swaps pages out to make some
+// (see swap.c), unless called with interrupts off, so with
+// a spinlock held, or while the caller may be using a user
+// page through its physical address.
 void *
 kalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
-
-  if(r)
+  if((r = kget()) == 0 && intr_get() && reclaim(KBATCH) > 0)
+    r = kget();
+  if(r){
     memset((char*)r, 5, PGSIZE); // fill with junk
+    refcnt[PA2PG(r)] = 1;
+  }
   return (void*)r;
 }
+
+// Return the smallest order of block that holds n bytes.
+int
+korder(uint64 n)
+{
+  int k;
+
+  for(k = 0; ((uint64)PGSIZE << k) < n; k++)
+    ;
+  return k;
+}
+
+// Allocate a physically contiguous block of 2^order pages.
+// Returns 0 if the memory cannot be allocated.
+void *
+kallocpages(int order)
+{
+  uint64 pa;
+
+  if(order < 0 || order > MAXORDER)
+    return 0;
+  if(order == 0)
+    return kalloc();
+  acquire(&buddy.lock);
+  pa = balloc(order);
+  release(&buddy.lock);
+  if(pa){
+    memset((char*)pa, 5, PGSIZE << order); // fill with junk
+    refcnt[PA2PG(pa)] = 1;
+  }
+  return (void*)pa;
+}
+
+// Free a block from kallocpages(order).
+void
+kfreepages(void *pa, int order)
+{
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(((uint64)pa % (PGSIZE << order)) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kfreepages");
+  if(__sync_sub_and_fetch(&refcnt[PA2PG(pa)], 1) != 0)
+    panic("kfreepages: ref");
+  memset(pa, 1, PGSIZE << order);
+  acquire(&buddy.lock);
+  bfree((uint64)pa, order);
+  release(&buddy.lock);
+}
+
+// Add a reference to an allocated page.
+void
+kref(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kref");
+  __sync_fetch_and_add(&refcnt[PA2PG(pa)], 1);
+}
+
+// Return the number of references to an allocated page.
+int
+krefs(void *pa)
+{
+  return __atomic_load_n(&refcnt[PA2PG(pa)], __ATOMIC_SEQ_CST);
+}
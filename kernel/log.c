@@ -54,7 +54,7 @@ static void commit();
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
+  if (sizeof(struct logheader) >= sb->bsize)
     panic("initlog: too big logheader");
 
   initlock(&log.lock, "log");
@@ -73,7 +73,7 @@ install_trans(int recovering)
   for (tail = 0; tail < log.lh.n; tail++) {
     struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
     struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
+    memmove(dbuf->data, lbuf->data, dbuf->size);  // copy block to dst
     bwrite(dbuf);  // write dst to disk
     if(recovering == 0)
       bunpin(dbuf);
@@ -183,7 +183,7 @@ write_log(void)
   for (tail = 0; tail < log.lh.n; tail++) {
     struct buf *to = bread(log.dev, log.start+tail+1); // log block
     struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
+    memmove(to->data, from->data, to->size);
     bwrite(to);  // write the log
     brelse(from);
     brelse(to);
@@ -27,6 +27,11 @@ main()
     binit();         // buffer cache
     iinit();         // inode table
     fileinit();      // file table
+    pipeinit();      // pipe cache
+    compressinit();  // compression contexts
+    pcinit();        // page cache
+    swapinit();      // compressed swap
+    futexinit();     // futex wait lock
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
     __sync_synchronize();
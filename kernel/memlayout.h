@@ -17,6 +17,11 @@
 // end -- start of kernel page allocation area
 // PHYSTOP -- end RAM used by the kernel
 
+// core local interruptor (CLINT), whose MSIP registers
+// let one hart interrupt another.
+#define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid))
+
 // qemu puts UART registers here in physical memory.
 #define UART0 0x10000000L
 #define UART0_IRQ 10
@@ -54,6 +59,14 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   mmap()ed regions
+//   threads' trapframes
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+
+// threads made by clone() share their process's page table,
+// so each has its trapframe at the page for its proc[] slot
+// below TRAPFRAME. A process's own memory ends at USERTOP.
+#define THREADFRAME(i) (TRAPFRAME - ((i)+1)*PGSIZE)
+#define USERTOP THREADFRAME(NPROC-1)
@@ -1,15 +1,30 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // i-node table entries kept before recycling
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       2000  // size of file system in blocks
+#define NBATCH        8  // max blocks per bulk readi/writei disk request
+#define NBUF         (MAXOPBLOCKS*3 + NBATCH*NCPU)  // min size of disk block cache; batches shrink when short
+#define MAXNBUF     512  // max size of disk block cache, for small blocks
+#define FSSIZE       2000  // default size of file system in blocks
 #define MAXPATH      128   // maximum file path name
 #define USERSTACK    1     // user stack pages
+#define NVMA         16    // file-backed regions per process
+#define NTLB         16    // user PTEs each process remembers; see uwalk()
+#define NPCACHE      256   // pages in the page cache
+#define KBATCH       32    // free pages a cpu moves at once
+#define NSWAPSLOT    8192  // compressed pages held by swap
+#define MAXORDER     10    // largest kallocpages() block is 2^MAXORDER pages
+#define MAGSIZE      8     // free objects each cpu keeps per slab cache
+#define PIPEORDER    0     // a pipe's buffer is 2^PIPEORDER pages
+#define NPRIO        3     // scheduling priority levels
+#define TIMEBASE     10000000 // time CSR cycles per second
+#define TIMESLICE    100000   // time slice at priority 0, cycles (10 ms)
+#define BOOSTINTERVAL 10000000  // cycles between priority boosts (1 s)
+#define IDLEPOLL     1000000  // cycles an idle cpu waits before looking
+                              // for work to steal (100 ms)
 
@@ -0,0 +1,344 @@
+// Page cache for file data.
+//
+// Holds page-sized pieces of files, keyed by device, inode
+// number and (page-aligned) offset. readi() and writei()
+// go through it for regular files, above the buffer cache,
+// and it holds compressed files' data decompressed. Processes
+// map its pages (see vmfault()), so that those running the
+// same program share its read-only pages. Pages are
+// reference counted by kalloc: the cache holds one
+// reference to each page and each mapping holds another,
+// so a page dropped from the cache stays valid for the
+// processes that still map it. A page that a MAP_SHARED
+// region maps is the file's one copy, so writes update it
+// in place; other mapped pages are dropped instead, so that
+// private and exec mappings keep the old contents.
+//
+// Entries are hashed by inode so pcinval() has only one
+// chain to scan, and recycled least recently used first,
+// passing over pages that processes map, so that a
+// MAP_SHARED page stays the one page of its file.
+//
+// Interface:
+// * pcget(ip, off, shared) returns a page with the file data
+//   at off, for a MAP_SHARED mapping if shared is set.
+// * pcwrite(ip, off, from) returns the cached page to put
+//   new data in, before it is written to the file.
+// * pcput(ip, off, src, n) caches data read along with
+//   another page.
+// * pcshared(ip) says whether any of ip's pages is mapped
+//   MAP_SHARED.
+// * pcinval(ip) forgets ip's pages.
+// * pcshrink(n) frees up to n pages that no process maps.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "defs.h"
+
+#define NPCBUCKET 31
+#define PCHASH(dev, inum) (((dev) * 31 + (inum)) % NPCBUCKET)
+
+struct pcpage {
+  uint dev;
+  uint inum;
+  uint64 off;
+  uint64 pa;                 // 0 if the entry is free
+  int shared;                // mapped by a MAP_SHARED region
+  struct pcpage *hnext;      // hash chain
+  struct pcpage *prev;       // LRU list, most recent first
+  struct pcpage *next;
+};
+
+struct {
+  struct spinlock lock;
+  struct pcpage page[NPCACHE];
+  struct pcpage *bucket[NPCBUCKET];
+  struct pcpage head;
+  uint gen;                  // bumped by each pcinval()
+} pcache;
+
+void
+pcinit(void)
+{
+  struct pcpage *e;
+
+  initlock(&pcache.lock, "pcache");
+  pcache.head.prev = &pcache.head;
+  pcache.head.next = &pcache.head;
+  for(e = pcache.page; e < pcache.page+NPCACHE; e++){
+    e->next = pcache.head.next;
+    e->prev = &pcache.head;
+    pcache.head.next->prev = e;
+    pcache.head.next = e;
+  }
+}
+
+// Remove e from its hash chain and drop the cache's
+// reference to its page.
+// Caller must hold pcache.lock.
+static void
+pcdrop(struct pcpage *e)
+{
+  struct pcpage **pp;
+
+  for(pp = &pcache.bucket[PCHASH(e->dev, e->inum)]; *pp != e; pp = &(*pp)->hnext)
+    ;
+  *pp = e->hnext;
+  kfree((void*)e->pa);
+  e->pa = 0;
+}
+
+// Move e to the least (tail) or most (head) recently
+// used end of the LRU list.
+// Caller must hold pcache.lock.
+static void
+pcmove(struct pcpage *e, int tohead)
+{
+  e->next->prev = e->prev;
+  e->prev->next = e->next;
+  if(tohead){
+    e->next = pcache.head.next;
+    e->prev = &pcache.head;
+  } else {
+    e->next = &pcache.head;
+    e->prev = pcache.head.prev;
+  }
+  e->next->prev = e;
+  e->prev->next = e;
+}
+
+// Look up ip's page at off.
+// Caller must hold pcache.lock.
+static struct pcpage*
+pclookup(struct inode *ip, uint64 off)
+{
+  struct pcpage *e;
+
+  for(e = pcache.bucket[PCHASH(ip->dev, ip->inum)]; e; e = e->hnext)
+    if(e->dev == ip->dev && e->inum == ip->inum && e->off == off)
+      return e;
+  return 0;
+}
+
+// Cache page mem as ip's page at off, taking over from
+// the least recently used page that no process maps.
+// Returns 0 if every page is mapped, so mem wasn't cached.
+// Caller must hold pcache.lock.
+static int
+pcinsert(struct inode *ip, uint64 off, char *mem, int shared)
+{
+  struct pcpage *e;
+
+  for(e = pcache.head.prev; e != &pcache.head; e = e->prev)
+    if(e->pa == 0 || krefs((void*)e->pa) == 1)
+      break;
+  if(e == &pcache.head)
+    return 0;
+  if(e->pa)
+    pcdrop(e);
+  e->dev = ip->dev;
+  e->inum = ip->inum;
+  e->off = off;
+  e->pa = (uint64)mem;
+  e->shared = shared;
+  e->hnext = pcache.bucket[PCHASH(ip->dev, ip->inum)];
+  pcache.bucket[PCHASH(ip->dev, ip->inum)] = e;
+  pcmove(e, 1);
+  kref(mem);
+  return 1;
+}
+
+// Return the physical address of a page holding ip's data
+// from byte off (page-aligned) on, zero past the end of the
+// file, with a reference for the caller, who must not write
+// to it. If shared is set, the caller is mapping it into a
+// MAP_SHARED region, and later writes will update it.
+// Reads the file if the page is not cached, so the
+// caller must not hold a spinlock.
+// Returns 0 if out of memory or the read failed, or if
+// shared is set but every cache page is mapped, so there
+// is no room for the page to be the file's one copy.
+uint64
+pcget(struct inode *ip, uint64 off, int shared)
+{
+  struct pcpage *e;
+  char *mem;
+  int locked, n;
+  uint gen;
+
+ again:
+  acquire(&pcache.lock);
+  if((e = pclookup(ip, off)) != 0){
+    kref((void*)e->pa);
+    e->shared |= shared;
+    pcmove(e, 1);
+    release(&pcache.lock);
+    return e->pa;
+  }
+  release(&pcache.lock);
+
+  if((mem = kalloc()) == 0)
+    return 0;
+  // the caller may be reading or writing ip itself, from or
+  // to a page that is not mapped yet.
+  if((locked = holdingsleep(&ip->lock)) == 0)
+    ilock(ip);
+  // ip can only change after we unlock it.
+  gen = __atomic_load_n(&pcache.gen, __ATOMIC_SEQ_CST);
+  n = readpage(ip, off, mem);
+  if(!locked)
+    iunlock(ip);
+  if(n < 0){
+    kfree(mem);
+    return 0;
+  }
+  memset(mem + n, 0, PGSIZE - n);
+
+  acquire(&pcache.lock);
+  if((e = pclookup(ip, off)) != 0){
+    // read by someone else meanwhile.
+    kfree(mem);
+    kref((void*)e->pa);
+    e->shared |= shared;
+    pcmove(e, 1);
+    release(&pcache.lock);
+    return e->pa;
+  }
+  if(pcache.gen != gen){
+    // ip may have changed since we read it; don't cache
+    // what we read, but this caller may still use it,
+    // unless it must map the file's one copy.
+    release(&pcache.lock);
+    if(shared){
+      kfree(mem);
+      goto again;
+    }
+    return (uint64)mem;
+  }
+  // if every page is mapped, this one isn't cached, which
+  // only a MAP_SHARED mapping can't live with.
+  if(pcinsert(ip, off, mem, shared) == 0 && shared){
+    release(&pcache.lock);
+    kfree(mem);
+    return 0;
+  }
+  release(&pcache.lock);
+  return (uint64)mem;
+}
+
+// Cache the n bytes at src, zero-filled to a page, as ip's
+// page at off, unless it is cached already. readpage() uses
+// it to keep all of a compressed file that it decompressed
+// for one page.
+// Caller must hold ip->lock, so that src is ip's current
+// data.
+void
+pcput(struct inode *ip, uint64 off, char *src, int n)
+{
+  char *mem;
+
+  if((mem = kalloc()) == 0)
+    return;
+  memmove(mem, src, n);
+  memset(mem + n, 0, PGSIZE - n);
+  acquire(&pcache.lock);
+  if(pclookup(ip, off) == 0)
+    pcinsert(ip, off, mem, 0);
+  release(&pcache.lock);
+  kfree(mem);  // the cache's reference, if any, remains
+}
+
+// Look up ip's cached page at off, before data in it is
+// written to the file. Returns it, with a reference for the
+// caller, who must copy the new data into it, if only the
+// cache holds it, a MAP_SHARED region maps it, or it is
+// from, the page the data is coming from. A page that
+// processes otherwise map is dropped instead, so they keep
+// the old contents. Returns 0 if the page is not (or no
+// longer) cached.
+uint64
+pcwrite(struct inode *ip, uint64 off, uint64 from)
+{
+  struct pcpage *e;
+  uint64 pa;
+
+  pa = 0;
+  acquire(&pcache.lock);
+  pcache.gen++;  // a page being read now may predate this write
+  if((e = pclookup(ip, off)) != 0){
+    if(e->pa == from || e->shared || krefs((void*)e->pa) == 1){
+      pa = e->pa;
+      kref((void*)pa);
+    } else {
+      pcdrop(e);
+      pcmove(e, 0);
+    }
+  }
+  release(&pcache.lock);
+  return pa;
+}
+
+// Return 1 if a MAP_SHARED region maps one of ip's pages.
+int
+pcshared(struct inode *ip)
+{
+  struct pcpage *e;
+  int r;
+
+  r = 0;
+  acquire(&pcache.lock);
+  for(e = pcache.bucket[PCHASH(ip->dev, ip->inum)]; e; e = e->hnext)
+    if(e->dev == ip->dev && e->inum == ip->inum && e->shared &&
+       krefs((void*)e->pa) > 1)
+      r = 1;
+  release(&pcache.lock);
+  return r;
+}
+
+// Forget the cached pages of ip, which is about to change.
+// Processes that map them keep the old contents.
+void
+pcinval(struct inode *ip)
+{
+  struct pcpage *e, *next;
+
+  acquire(&pcache.lock);
+  pcache.gen++;
+  for(e = pcache.bucket[PCHASH(ip->dev, ip->inum)]; e; e = next){
+    next = e->hnext;
+    if(e->dev == ip->dev && e->inum == ip->inum){
+      pcdrop(e);
+      pcmove(e, 0);
+    }
+  }
+  release(&pcache.lock);
+}
+
+// Drop up to n of the least recently used pages that only
+// the cache holds, when memory is short.
+// Returns the number of pages freed.
+int
+pcshrink(int n)
+{
+  struct pcpage *e, *prev;
+  int freed;
+
+  freed = 0;
+  acquire(&pcache.lock);
+  for(e = pcache.head.prev; e != &pcache.head && freed < n; e = prev){
+    prev = e->prev;
+    if(e->pa && krefs((void*)e->pa) == 1){
+      pcdrop(e);
+      pcmove(e, 0);
+      freed++;
+    }
+  }
+  release(&pcache.lock);
+  return freed;
+}
@@ -26,6 +26,34 @@ extern char trampoline[]; // trampoline.S
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
+// Multilevel feedback scheduling: a process runs at priority
+// level p->prio, and is demoted one level whenever it has run
+// for its level's time slice, which doubles at each level.
+// Processes that sleep before using a slice keep their level.
+// Every BOOSTINTERVAL a new boost generation starts and
+// each process returns to the level given by its nice value.
+#define QUANTUM(prio) ((uint64)TIMESLICE << (prio))
+#define NICEPRIO(nice) ((nice) * NPRIO / 20)
+#define BOOSTGEN() ((uint)(r_time() / BOOSTINTERVAL))
+
+#define ALLCPUS ((1U << NCPU) - 1)
+#define CANRUN(p, c) ((p)->affinity & (1U << ((c) - cpus)))
+
+static uint cpusup;  // cpus that have entered scheduler()
+
+// Sleeping processes are chained in the hash bucket of
+// their wait channel, so wakeup() only looks at processes
+// sleeping on channels that hash alike.
+// Lock order: the caller's lock passed to sleep(), then
+// a bucket's lock, then p->lock.
+#define NSLEEPQ 61
+#define SLEEPQ(chan) (&sleepq[(uint64)(chan) / sizeof(uint64) % NSLEEPQ])
+
+struct sleepq {
+  struct spinlock lock;
+  struct proc *head;
+} sleepq[NSLEEPQ];
+
 // Allocate a page for each process's kernel stack.
 // Map it high in memory, followed by an invalid
 // guard page.
@@ -48,9 +76,15 @@ void
 procinit(void)
 {
   struct proc *p;
+  struct cpu *c;
+  struct sleepq *q;
   
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  for(c = cpus; c < &cpus[NCPU]; c++)
+    initlock(&c->rq.lock, "runq");
+  for(q = sleepq; q < &sleepq[NSLEEPQ]; q++)
+    initlock(&q->lock, "sleepq");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
       p->state = UNUSED;
@@ -89,6 +123,191 @@ myproc(void)
   return p;
 }
 
+// Make sure no cpu still has translations from pagetable
+// cached, before pages that it mapped are freed: threads
+// sharing it may be running on other cpus. Those in user
+// space are interrupted (see ipivec), and waited for until
+// trapping has flushed their TLBs. Cpus in the kernel have
+// already flushed theirs, and flush again on the way out,
+// so they are left alone, and the wait can't deadlock on a
+// lock that the caller holds.
+void
+tlbshootdown(pagetable_t pagetable)
+{
+  uint cross[NCPU];
+  struct proc *p;
+  int i;
+
+  // make the caller's page table changes visible before
+  // looking at the cpus; see usertrapret().
+  __sync_synchronize();
+  for(i = 0; i < NCPU; i++){
+    cross[i] = __atomic_load_n(&cpus[i].ucross, __ATOMIC_SEQ_CST);
+    p = __atomic_load_n(&cpus[i].proc, __ATOMIC_SEQ_CST);
+    if(cross[i] % 2 == 0 || p == 0 || p->pagetable != pagetable)
+      cross[i] = 0;  // in the kernel, or another process
+    else
+      *(volatile uint32*)CLINT_MSIP(i) = 1;
+  }
+  for(i = 0; i < NCPU; i++)
+    while(cross[i] && __atomic_load_n(&cpus[i].ucross, __ATOMIC_SEQ_CST) == cross[i])
+      ;
+}
+
+// Append p to c's run queue for its priority level.
+// Caller must hold p->lock.
+static void
+runqput(struct cpu *c, struct proc *p)
+{
+  int l = p->prio;
+
+  acquire(&c->rq.lock);
+  p->rqnext = 0;
+  if(c->rq.tail[l])
+    c->rq.tail[l]->rqnext = p;
+  else
+    c->rq.head[l] = p;
+  c->rq.tail[l] = p;
+  c->rq.n++;
+  release(&c->rq.lock);
+}
+
+// Remove and return the first process of the highest
+// priority level of c's run queue that may run on cpu
+// who, or 0 if there is none.
+static struct proc*
+runqget(struct cpu *c, struct cpu *who)
+{
+  struct proc *p, *prev, *next;
+  int l;
+
+  acquire(&c->rq.lock);
+  if(c->rq.boostgen != BOOSTGEN()){
+    // Boost: move everything queued to the level given by
+    // its nice value, keeping the order of the levels.
+    c->rq.boostgen = BOOSTGEN();
+    next = 0;
+    for(l = NPRIO-1; l >= 0; l--){
+      if(c->rq.head[l] == 0)
+        continue;
+      c->rq.tail[l]->rqnext = next;
+      next = c->rq.head[l];
+      c->rq.head[l] = c->rq.tail[l] = 0;
+    }
+    for(p = next; p; p = next){
+      next = p->rqnext;
+      // p->nice is read without p->lock; applyboost() sets
+      // p->prio to match at its next tick.
+      l = NICEPRIO(p->nice);
+      p->rqnext = 0;
+      if(c->rq.tail[l])
+        c->rq.tail[l]->rqnext = p;
+      else
+        c->rq.head[l] = p;
+      c->rq.tail[l] = p;
+    }
+  }
+  for(l = 0; l < NPRIO; l++){
+    prev = 0;
+    // p->affinity is read without p->lock; scheduler() rechecks.
+    for(p = c->rq.head[l]; p && !CANRUN(p, who); p = p->rqnext)
+      prev = p;
+    if(p){
+      if(prev)
+        prev->rqnext = p->rqnext;
+      else
+        c->rq.head[l] = p->rqnext;
+      if(c->rq.tail[l] == p)
+        c->rq.tail[l] = prev;
+      c->rq.n--;
+      release(&c->rq.lock);
+      return p;
+    }
+  }
+  release(&c->rq.lock);
+  return 0;
+}
+
+// Take a process that may run on c from another cpu's run
+// queue, trying the longest queue first, or return 0 if
+// there is none to take.
+static struct proc*
+runqsteal(struct cpu *c)
+{
+  struct cpu *victim, *v;
+  struct proc *p;
+
+  victim = 0;
+  for(v = cpus; v < &cpus[NCPU]; v++){
+    // rq.n is only a hint here; runqget() rechecks under the lock.
+    if(v != c && v->rq.n > 0 && (victim == 0 || v->rq.n > victim->rq.n))
+      victim = v;
+  }
+  if(victim == 0)
+    return 0;
+  if((p = runqget(victim, c)) != 0)
+    return p;
+  // everything there may be pinned elsewhere.
+  for(v = cpus; v < &cpus[NCPU]; v++)
+    if(v != c && v != victim && v->rq.n > 0 && (p = runqget(v, c)) != 0)
+      return p;
+  return 0;
+}
+
+// Return p to its nice level if there has been a priority
+// boost since it last ran.
+// Caller must hold p->lock.
+static void
+applyboost(struct proc *p)
+{
+  if(p->boostgen != BOOSTGEN()){
+    p->boostgen = BOOSTGEN();
+    p->prio = NICEPRIO(p->nice);
+    p->used = 0;
+  }
+}
+
+// Charge p for the cycles it has run since it was last
+// dispatched or charged.
+// Caller must hold p->lock.
+static void
+charge(struct proc *p)
+{
+  uint64 now = r_time();
+
+  p->used += now - p->lastrun;
+  p->runtime += now - p->lastrun;
+  p->lastrun = now;
+}
+
+// Mark p RUNNABLE and queue it, preferably on the cpu it
+// last ran on, whose caches may still hold its working set.
+// Idle cpus steal from busy ones.
+// Caller must hold p->lock.
+static void
+setrunnable(struct proc *p)
+{
+  struct cpu *c, *last;
+
+  applyboost(p);
+  p->state = RUNNABLE;
+
+  // Without inter-processor interrupts an idle cpu only notices
+  // new work every IDLEPOLL, so go back to the last cpu only if
+  // it is busy (it will get to p within a few time slices) or is
+  // this one.
+  c = mycpu();
+  last = p->lastcpu >= 0 ? &cpus[p->lastcpu] : 0;
+  if(last && CANRUN(p, last) && (last == c || last->proc != 0))
+    c = last;
+  else if(!CANRUN(p, c)){
+    for(c = cpus; !CANRUN(p, c); c++)
+      ;
+  }
+  runqput(c, p);
+}
+
+
 int
 allocpid()
 {
@@ -104,10 +323,12 @@ allocpid()
 
 // Look in the process table for an UNUSED proc.
 // If found, initialize state required to run in the kernel,
-// and return with p->lock held.
+// and return with p->lock held. A new process gets its own
+// page table; a thread of leader shares leader's, with its
+// trapframe mapped at its own address.
 // If there are no free procs, or a memory allocation fails, return 0.
 static struct proc*
-allocproc(void)
+allocproc(struct proc *leader)
 {
   struct proc *p;
 
@@ -124,6 +345,15 @@ allocproc(void)
 found:
   p->pid = allocpid();
   p->state = USED;
+  p->nice = 0;
+  p->prio = 0;
+  p->boostgen = BOOSTGEN();
+  p->used = 0;
+  p->runtime = 0;
+  p->tcpu = -1;
+  p->lastcpu = -1;
+  p->affinity = ALLCPUS;
+  p->nthread = 0;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -132,12 +362,25 @@ found:
     return 0;
   }
 
-  // An empty user page table.
-  p->pagetable = proc_pagetable(p);
-  if(p->pagetable == 0){
-    freeproc(p);
-    release(&p->lock);
-    return 0;
+  if(leader){
+    p->leader = leader;
+    p->tfva = THREADFRAME(p - proc);
+    if(uvmmap(leader->pagetable, p->tfva, (uint64)p->trapframe, PTE_R | PTE_W) < 0){
+      freeproc(p);
+      release(&p->lock);
+      return 0;
+    }
+    p->pagetable = leader->pagetable;
+  } else {
+    p->leader = p;
+    p->tfva = TRAPFRAME;
+    // An empty user page table.
+    p->pagetable = proc_pagetable(p);
+    if(p->pagetable == 0){
+      freeproc(p);
+      release(&p->lock);
+      return 0;
+    }
   }
 
   // Set up new context to start executing at forkret,
@@ -158,9 +401,13 @@ freeproc(struct proc *p)
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
-  if(p->pagetable)
+  if(p->pagetable && p->leader != p)
+    uvmunmap(p->pagetable, p->tfva, 1, 0);
+  else if(p->pagetable)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
+  p->leader = 0;
+  memset(p->tlb, 0, sizeof(p->tlb));
   p->sz = 0;
   p->pid = 0;
   p->parent = 0;
@@ -234,7 +481,7 @@ userinit(void)
 {
   struct proc *p;
 
-  p = allocproc();
+  p = allocproc(0);
   initproc = p;
   
   // allocate one user page and copy initcode's instructions
@@ -249,29 +496,35 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&p->lock);
 }
 
-// Grow or shrink user memory by n bytes.
-// Return 0 on success, -1 on failure.
-int
+// Grow or shrink user memory by n bytes. Growing only
+// reserves address space; vmfault() maps pages on first use.
+// Return the old size, which threads calling together each
+// see differently, or -1 on failure.
+uint64
 growproc(int n)
 {
-  uint64 sz;
-  struct proc *p = myproc();
+  uint64 sz, oldsz;
+  struct proc *p = myproc()->leader;
 
-  sz = p->sz;
+  acquire(&p->lock);
+  sz = oldsz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    if(sz + n >= vmabase(p)){
+      release(&p->lock);
       return -1;
     }
+    sz += n;
   } else if(n < 0){
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
   p->sz = sz;
-  return 0;
+  release(&p->lock);
+  return oldsz;
 }
 
 // Create a new process, copying the parent.
@@ -279,22 +532,29 @@ growproc(int n)
 int
 fork(void)
 {
-  int i, pid;
+  int i, pid, copy;
   struct proc *np;
   struct proc *p = myproc();
+  struct proc *lp = p->leader;
 
   // Allocate process.
-  if((np = allocproc()) == 0){
+  if((np = allocproc(0)) == 0){
     return -1;
   }
 
-  // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  // Copy user memory from parent to child. Threads may be
+  // writing to it on other cpus, which can't be told to stop,
+  // so copy-on-write won't do.
+  acquire(&lp->lock);
+  copy = lp->nthread > 0;
+  release(&lp->lock);
+  if(uvmcopy(lp->pagetable, np->pagetable, lp->sz, copy) < 0 ||
+     vmacopy(lp->pagetable, np->pagetable, lp->vma, copy) < 0){
     freeproc(np);
     release(&np->lock);
     return -1;
   }
-  np->sz = p->sz;
+  np->sz = lp->sz;
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -304,12 +564,21 @@ fork(void)
 
   // increment reference counts on open file descriptors.
   for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
-  np->cwd = idup(p->cwd);
+    if(lp->ofile[i])
+      np->ofile[i] = filedup(lp->ofile[i]);
+  np->cwd = idup(lp->cwd);
+  for(i = 0; i < NVMA; i++){
+    np->vma[i] = lp->vma[i];
+    if(lp->vma[i].ip)
+      idup(lp->vma[i].ip);
+  }
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
+  np->nice = p->nice;
+  np->affinity = p->affinity;
+  np->prio = NICEPRIO(np->nice);
+
   pid = np->pid;
 
   release(&np->lock);
@@ -319,12 +588,150 @@ fork(void)
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
 }
 
+// Start a thread of the calling process, running fn(arg) on
+// the user stack that ends at stack, with its thread pointer
+// register (tp) set to tls. The thread shares the process's
+// memory, open files and current directory.
+// Returns the thread's id, or -1.
+int
+clone(uint64 fn, uint64 arg, uint64 stack, uint64 tls)
+{
+  struct proc *np;
+  struct proc *p = myproc();
+  struct proc *lp = p->leader;
+  int tid;
+
+  if((np = allocproc(lp)) == 0)
+    return -1;
+
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->sp = stack;
+  np->trapframe->a0 = arg;
+  np->trapframe->tp = tls;
+  np->trapframe->ra = 0;  // fn must call exit()
+
+  safestrcpy(np->name, p->name, sizeof(p->name));
+  np->nice = p->nice;
+  np->affinity = p->affinity;
+  np->prio = NICEPRIO(np->nice);
+  tid = np->pid;
+  release(&np->lock);
+
+  acquire(&wait_lock);
+  np->parent = lp;
+  release(&wait_lock);
+
+  acquire(&lp->lock);
+  lp->nthread++;
+  release(&lp->lock);
+
+  acquire(&np->lock);
+  setrunnable(np);
+  release(&np->lock);
+
+  return tid;
+}
+
+// Free zombie thread pp of process lp.
+// Caller must hold wait_lock and pp->lock, which this
+// releases.
+static void
+reapthread(struct proc *lp, struct proc *pp)
+{
+  freeproc(pp);
+  release(&pp->lock);
+  acquire(&lp->lock);
+  lp->nthread--;
+  release(&lp->lock);
+}
+
+// Wait for thread tid of the calling process (or any
+// other thread, if tid is 0) to exit, and copy its exit
+// status to addr. Returns its id, or -1.
+int
+join(int tid, uint64 addr)
+{
+  struct proc *pp;
+  int found;
+  struct proc *p = myproc();
+  struct proc *lp = p->leader;
+
+  acquire(&wait_lock);
+  for(;;){
+    found = 0;
+    for(pp = proc; pp < &proc[NPROC]; pp++){
+      if(pp->parent != lp || pp == p)
+        continue;
+      acquire(&pp->lock);
+      if(pp->leader == lp && pp != lp && (tid == 0 || pp->pid == tid)){
+        found = 1;
+        if(pp->state == ZOMBIE){
+          tid = pp->pid;
+          if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
+                                  sizeof(pp->xstate)) < 0) {
+            release(&pp->lock);
+            release(&wait_lock);
+            return -1;
+          }
+          reapthread(lp, pp);
+          release(&wait_lock);
+          return tid;
+        }
+      }
+      release(&pp->lock);
+    }
+
+    if(!found || killed(p)){
+      release(&wait_lock);
+      return -1;
+    }
+
+    // exiting threads wake their process.
+    sleep(lp, &wait_lock);
+  }
+}
+
+// Kill the calling process's other threads and wait for
+// them to exit. Called by the process, not a thread.
+static void
+killthreads(struct proc *p)
+{
+  struct proc *pp;
+  int n;
+
+  acquire(&wait_lock);
+  for(;;){
+    n = 0;
+    for(pp = proc; pp < &proc[NPROC]; pp++){
+      if(pp->parent != p)
+        continue;
+      acquire(&pp->lock);
+      if(pp->leader == p && pp != p){
+        if(pp->state == ZOMBIE){
+          reapthread(p, pp);
+          continue;
+        }
+        pp->killed = 1;
+        if(pp->state == SLEEPING)
+          setrunnable(pp);
+        n++;
+      }
+      release(&pp->lock);
+    }
+    if(n == 0)
+      break;
+    sleep(p, &wait_lock);
+  }
+  release(&wait_lock);
+}
+
 // Pass p's abandoned children to init.
 // Caller must hold wait_lock.
 void
@@ -351,6 +758,13 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // A thread leaves the memory and files to its process,
+  // which frees them once its last thread has gone.
+  if(p->leader != p)
+    goto zombie;
+  if(p->nthread > 0)
+    killthreads(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -360,11 +774,13 @@ exit(int status)
     }
   }
 
+  vmaput(p->pagetable, p->vma);
   begin_op();
   iput(p->cwd);
   end_op();
   p->cwd = 0;
 
+ zombie:
   acquire(&wait_lock);
 
   // Give any children to init.
@@ -403,6 +819,11 @@ wait(uint64 addr)
       if(pp->parent == p){
         // make sure the child isn't still in exit() or swtch().
         acquire(&pp->lock);
+        if(pp->leader != pp){
+          // a thread; see join().
+          release(&pp->lock);
+          continue;
+        }
 
         havekids = 1;
         if(pp->state == ZOMBIE){
@@ -437,7 +858,8 @@ wait(uint64 addr)
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - take a process from this CPU's run queue, or
+//    steal one from the busiest other queue.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
@@ -448,35 +870,44 @@ scheduler(void)
   struct cpu *c = mycpu();
 
   c->proc = 0;
+  __sync_fetch_and_or(&cpusup, 1U << (c - cpus));
   for(;;){
     // The most recent process to run may have had interrupts
     // turned off; enable them to avoid a deadlock if all
     // processes are waiting.
     intr_on();
 
-    int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-        found = 1;
-      }
-      release(&p->lock);
-    }
-    if(found == 0) {
+    if((p = runqget(c, c)) == 0 && (p = runqsteal(c)) == 0){
       // nothing to run; stop running on this core until an interrupt.
       intr_on();
       asm volatile("wfi");
+      continue;
     }
+
+    // A queued process stays RUNNABLE, but the cpu that queued
+    // it may still be switching away from it while holding
+    // p->lock.
+    acquire(&p->lock);
+    if(p->state == RUNNABLE && !CANRUN(p, c)){
+      // setaffinity() raced with runqget().
+      setrunnable(p);
+    } else if(p->state == RUNNABLE) {
+      // Switch to chosen process.  It is the process's job
+      // to release its lock and then reacquire it
+      // before jumping back to us.
+      p->state = RUNNING;
+      p->lastrun = r_time();
+      p->lastcpu = c - cpus;
+      c->proc = p;
+      timerslice();
+      swtch(&c->context, &p->context);
+
+      // Process is done running for now.
+      // It should have changed its p->state before coming back.
+      c->proc = 0;
+      charge(p);
+    }
+    release(&p->lock);
   }
 }
 
@@ -513,11 +944,104 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
 
+// Called on each timer interrupt while a process runs on
+// this cpu. Demotes the process and gives up the cpu once it
+// has used its level's time slice, and also gives up the cpu
+// if a higher-priority process is waiting on this cpu.
+void
+schedtick(void)
+{
+  struct proc *p = myproc();
+  struct cpu *c;
+  int l, preempt;
+
+  acquire(&p->lock);
+  charge(p);
+  applyboost(p);
+  preempt = 0;
+  if(p->used >= QUANTUM(p->prio)){
+    if(p->prio < NPRIO-1)
+      p->prio++;
+    p->used = 0;
+    preempt = 1;
+  } else {
+    // a racy peek is fine; the next tick will look again.
+    c = mycpu();
+    for(l = 0; l < p->prio; l++)
+      if(c->rq.head[l])
+        preempt = 1;
+  }
+  if(preempt){
+    setrunnable(p);
+    sched();
+  }
+  release(&p->lock);
+}
+
+// Add incr to the calling process's nice value, clamped to
+// 0..19, and return the new value. Higher values start the
+// process at lower priority levels after each boost.
+int
+nice(int incr)
+{
+  struct proc *p = myproc();
+  int n;
+
+  acquire(&p->lock);
+  n = p->nice + incr;
+  if(n < 0)
+    n = 0;
+  if(n > 19)
+    n = 19;
+  p->nice = n;
+  if(p->prio < NICEPRIO(n))
+    p->prio = NICEPRIO(n);
+  release(&p->lock);
+  return n;
+}
+
+// Restrict the process with the given pid (or the caller,
+// if pid is 0) to the cpus in mask, bit i for cpu i.
+// Returns the previous mask, or -1.
+int
+setaffinity(int pid, uint mask)
+{
+  struct proc *p;
+  int old;
+
+  mask &= cpusup;
+  if(mask == 0)
+    return -1;
+  if(pid == 0)
+    pid = myproc()->pid;
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED){
+      old = p->affinity;
+      p->affinity = mask;
+      release(&p->lock);
+      // a queued process is moved by scheduler(), a running one
+      // when it is next preempted. move the caller now.
+      if(p == myproc()){
+        push_off();
+        if(!CANRUN(p, mycpu())){
+          pop_off();
+          yield();
+        } else
+          pop_off();
+      }
+      return old;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
 // A fork child's very first scheduling by scheduler()
 // will swtch to forkret.
 void
@@ -548,28 +1072,45 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct sleepq *q = SLEEPQ(chan);
+  struct proc **pp;
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once we hold chan's bucket lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks the bucket),
   // so it's okay to release lk.
 
+  acquire(&q->lock);
   acquire(&p->lock);  //DOC: sleeplock1
   release(lk);
 
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->sqnext = q->head;
+  q->head = p;
+  release(&q->lock);
 
   sched();
 
   // Tidy up.
   p->chan = 0;
+  release(&p->lock);
+
+  // wakeup() unchains the processes it wakes, but kill()
+  // can't take the bucket lock while holding p->lock.
+  acquire(&q->lock);
+  for(pp = &q->head; *pp; pp = &(*pp)->sqnext){
+    if(*pp == p){
+      *pp = p->sqnext;
+      break;
+    }
+  }
+  release(&q->lock);
 
   // Reacquire original lock.
-  release(&p->lock);
   acquire(lk);
 }
 
@@ -578,17 +1119,33 @@ sleep(void *chan, struct spinlock *lk)
 void
 wakeup(void *chan)
 {
-  struct proc *p;
+  wakeupn(chan, NPROC);
+}
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
-      acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
+// Wake up at most n processes sleeping on chan.
+// Returns the number woken.
+// Must be called without any p->lock.
+int
+wakeupn(void *chan, int n)
+{
+  struct sleepq *q = SLEEPQ(chan);
+  struct proc *p, **pp;
+  int woken = 0;
+
+  acquire(&q->lock);
+  for(pp = &q->head; (p = *pp) != 0 && woken < n; ){
+    acquire(&p->lock);
+    if(p->state == SLEEPING && p->chan == chan) {
+      setrunnable(p);
+      *pp = p->sqnext;
+      woken++;
+    } else {
+      pp = &p->sqnext;
     }
+    release(&p->lock);
   }
+  release(&q->lock);
+  return woken;
 }
 
 // Kill the process with the given pid.
@@ -605,7 +1162,7 @@ kill(int pid)
       p->killed = 1;
       if(p->state == SLEEPING){
         // Wake process from sleep().
-        p->state = RUNNABLE;
+        setrunnable(p);
       }
       release(&p->lock);
       return 0;
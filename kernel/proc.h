@@ -18,12 +18,24 @@ struct context {
   uint64 s11;
 };
 
+// Per-CPU queues of RUNNABLE processes, one per priority
+// level, linked through p->rqnext.
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+  int n;                      // Number of queued processes.
+  uint boostgen;              // Last priority boost applied.
+};
+
 // Per-CPU state.
 struct cpu {
   struct proc *proc;          // The process running on this cpu, or null.
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  struct runq rq;             // Processes waiting to run on this cpu.
+  uint ucross;                // Entries to and exits from user space; odd in user space.
 };
 
 extern struct cpu cpus[NCPU];
@@ -79,6 +91,27 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A region of a process's memory whose contents come from
+// a file, faulted in a page at a time by vmfault(): a
+// program's segment, or a mapping made by mmap(), which
+// may also be of anonymous, zero-filled memory.
+struct vma {
+  struct inode *ip;            // 0 for anonymous memory
+  uint64 start;                // Page-aligned virtual address range
+  uint64 end;                  // 0 if this slot is unused
+  uint64 off;                  // File offset of start, page-aligned
+  uint64 filesz;               // Bytes of file data; zero after that
+  int perm;                    // PTE permission bits
+  int flags;                   // MAP_SHARED or MAP_PRIVATE from mmap(), else 0
+};
+
+// A user page's PTE, remembered to save walking the page
+// table again.
+struct tlbent {
+  uint64 va;                   // Page-aligned user address
+  pte_t *pte;                  // 0 if the entry is unused
+};
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -91,17 +124,42 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int nice;                    // Niceness, 0 to 19
+  int prio;                    // Priority level, 0 is highest
+  uint boostgen;               // Last priority boost applied
+  uint64 used;                 // Cycles run at this level
+  uint64 runtime;              // Total cycles run
+  uint64 lastrun;              // When last dispatched or charged
+  int lastcpu;                 // Cpu it last ran on, or -1
+  uint affinity;               // Cpus it may run on, bit i for cpu i
+  int nthread;                 // Threads made by clone() not yet joined
+
+  // the lock of the cpu's timer heap must be held when using these:
+  uint64 wakeat;               // Deadline for timersleep()
+  int tcpu;                    // Timer heap holding p, or -1
+  int tidx;                    // Index in that heap
+
+  // the run queue's lock must be held when using this:
+  struct proc *rqnext;         // Next process in run queue
+
+  // the sleep queue's lock must be held when using this:
+  struct proc *sqnext;         // Next process in sleep queue
 
   // wait_lock must be held when using this:
-  struct proc *parent;         // Parent process
+  struct proc *parent;         // Parent process, or a thread's process
 
   // these are private to the process, so p->lock need not be held.
+  // a thread uses its leader's sz, ofile, cwd and vma.
+  struct proc *leader;         // Process a thread belongs to; else p itself
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
-  pagetable_t pagetable;       // User page table
+  pagetable_t pagetable;       // User page table, shared by threads
   struct trapframe *trapframe; // data page for trampoline.S
+  uint64 tfva;                 // User address of trapframe
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct vma vma[NVMA];        // File-backed memory
+  struct tlbent tlb[NTLB];     // Software TLB for copyin() and copyout()
   char name[16];               // Process name (debugging)
 };
@@ -0,0 +1,164 @@
+// Slab allocator, for kernel objects smaller than a page.
+//
+// Each type of object has its own slabcache. A slab is one
+// page from kalloc(): a header, a stack of the indices of
+// its free objects, then the objects. A slab goes back to
+// kalloc() once none of its objects is in use.
+//
+// An object is constructed (ctor) once, when its slab is
+// made, and must be returned to slabfree() in its
+// constructed state, so that fields like locks need not be
+// set up again on each allocation.
+//
+// Each cpu keeps a magazine of up to MAGSIZE free objects
+// per cache, so most allocations and frees don't touch the
+// cache's lock; magazines are refilled and emptied half a
+// magazine at a time.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "slab.h"
+#include "defs.h"
+
+struct slab {
+  struct slabcache *cache;
+  struct slab *prev;          // partial list
+  struct slab *next;
+  int inuse;                  // objects allocated or in magazines
+  int nfree;
+  ushort free[];              // indices of free objects
+};
+
+#define OBJ(c, s, i) ((char*)(s) + PGSIZE - ((c)->nper - (i)) * (c)->size)
+
+void
+slabinit(struct slabcache *c, char *name, uint size, void (*ctor)(void*))
+{
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = (size + 7) & ~7;
+  c->nper = (PGSIZE - sizeof(struct slab)) / (c->size + sizeof(ushort));
+  if(c->nper == 0)
+    panic("slabinit: too big");
+  c->ctor = ctor;
+  c->partial = 0;
+}
+
+static void
+partialadd(struct slabcache *c, struct slab *s)
+{
+  s->prev = 0;
+  s->next = c->partial;
+  if(c->partial)
+    c->partial->prev = s;
+  c->partial = s;
+}
+
+static void
+partialremove(struct slabcache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+}
+
+// Make a new slab and put it on c's partial list.
+// Caller must hold c->lock.
+static struct slab*
+slabgrow(struct slabcache *c)
+{
+  struct slab *s;
+  int i;
+
+  if((s = kalloc()) == 0)
+    return 0;
+  s->cache = c;
+  s->inuse = 0;
+  s->nfree = c->nper;
+  for(i = 0; i < c->nper; i++){
+    s->free[i] = c->nper - 1 - i;
+    if(c->ctor)
+      c->ctor(OBJ(c, s, i));
+  }
+  partialadd(c, s);
+  return s;
+}
+
+// Move up to n objects from c's slabs to magazine m.
+static void
+refill(struct slabcache *c, struct magazine *m, int n)
+{
+  struct slab *s;
+
+  acquire(&c->lock);
+  while(n-- > 0){
+    if((s = c->partial) == 0 && (s = slabgrow(c)) == 0)
+      break;
+    m->obj[m->n++] = OBJ(c, s, s->free[--s->nfree]);
+    s->inuse++;
+    if(s->nfree == 0)
+      partialremove(c, s);
+  }
+  release(&c->lock);
+}
+
+// Return n objects from magazine m to their slabs.
+static void
+drain(struct slabcache *c, struct magazine *m, int n)
+{
+  struct slab *s;
+  char *o;
+
+  acquire(&c->lock);
+  while(n-- > 0){
+    o = m->obj[--m->n];
+    s = (struct slab*)PGROUNDDOWN((uint64)o);
+    if(s->cache != c)
+      panic("slabfree: wrong cache");
+    if(s->nfree == 0)
+      partialadd(c, s);
+    s->free[s->nfree++] = (o - OBJ(c, s, 0)) / c->size;
+    if(--s->inuse == 0){
+      partialremove(c, s);
+      kfree(s);
+    }
+  }
+  release(&c->lock);
+}
+
+// Allocate an object from c.
+// Returns 0 if out of memory.
+void*
+slaballoc(struct slabcache *c)
+{
+  struct magazine *m;
+  void *o;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == 0)
+    refill(c, m, MAGSIZE/2);
+  o = m->n > 0 ? m->obj[--m->n] : 0;
+  pop_off();
+  return o;
+}
+
+// Return object o to c.
+void
+slabfree(struct slabcache *c, void *o)
+{
+  struct magazine *m;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == MAGSIZE)
+    drain(c, m, MAGSIZE/2);
+  m->obj[m->n++] = o;
+  pop_off();
+}
@@ -0,0 +1,18 @@
+// Per-cpu stack of free objects, used with interrupts
+// off instead of a lock.
+struct magazine {
+  int n;
+  void *obj[MAGSIZE];
+};
+
+// A cache of objects of one type and size, carved out of
+// page-sized slabs.
+struct slabcache {
+  struct spinlock lock;
+  char *name;
+  uint size;                  // Object size, rounded up to 8 bytes
+  uint nper;                  // Objects per slab
+  void (*ctor)(void*);        // Called once per object, when its slab is made
+  struct slab *partial;       // Slabs with free objects
+  struct magazine mag[NCPU];
+};
@@ -6,10 +6,14 @@
 
 void main();
 void timerinit();
+void ipivec();
 
 // entry.S needs one stack per CPU.
 __attribute__ ((aligned (16))) char stack0[4096 * NCPU];
 
+// scratch space for ipivec in kernelvec.S, one per CPU.
+uint64 ipiscratch[NCPU][2];
+
 // entry.S jumps here in machine mode on stack0.
 void
 start()
@@ -44,6 +48,13 @@ start()
   int id = r_mhartid();
   w_tp(id);
 
+  // other harts interrupt this one through its CLINT MSIP
+  // register; ipivec passes the interrupt on to supervisor
+  // mode.
+  w_mscratch((uint64)ipiscratch[id]);
+  w_mtvec((uint64)ipivec);
+  w_mie(r_mie() | MIE_MSIE);
+
   // switch to supervisor mode and jump to main().
   asm volatile("mret");
 }
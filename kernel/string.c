@@ -27,11 +27,15 @@ memcmp(const void *v1, const void *v2, uint n)
   return 0;
 }
 
+// Copies 8-byte words, four at a time, when src and dst
+// are equally aligned, and bytes otherwise.
 void*
 memmove(void *dst, const void *src, uint n)
 {
   const char *s;
   char *d;
+  const uint64 *ws;
+  uint64 *wd;
 
   if(n == 0)
     return dst;
@@ -41,11 +45,46 @@ memmove(void *dst, const void *src, uint n)
   if(s < d && s + n > d){
     s += n;
     d += n;
+    if((((uint64)s ^ (uint64)d) & 7) == 0){
+      for(; n > 0 && ((uint64)d & 7); n--)
+        *--d = *--s;
+      ws = (const uint64*)s;
+      wd = (uint64*)d;
+      for(; n >= 32; n -= 32){
+        wd -= 4, ws -= 4;
+        wd[3] = ws[3];
+        wd[2] = ws[2];
+        wd[1] = ws[1];
+        wd[0] = ws[0];
+      }
+      for(; n >= 8; n -= 8)
+        *--wd = *--ws;
+      s = (const char*)ws;
+      d = (char*)wd;
+    }
     while(n-- > 0)
       *--d = *--s;
-  } else
+  } else {
+    if((((uint64)s ^ (uint64)d) & 7) == 0){
+      for(; n > 0 && ((uint64)d & 7); n--)
+        *d++ = *s++;
+      ws = (const uint64*)s;
+      wd = (uint64*)d;
+      for(; n >= 32; n -= 32){
+        wd[0] = ws[0];
+        wd[1] = ws[1];
+        wd[2] = ws[2];
+        wd[3] = ws[3];
+        wd += 4, ws += 4;
+      }
+      for(; n >= 8; n -= 8)
+        *wd++ = *ws++;
+      s = (const char*)ws;
+      d = (char*)wd;
+    }
     while(n-- > 0)
       *d++ = *s++;
+  }
 
   return dst;
 }
@@ -0,0 +1,234 @@
+// Compressed swap, kept in memory.
+//
+// When kalloc() runs out of pages it calls reclaim(), which
+// first drops pages that only the page cache holds, then
+// swaps out cold user pages: it compresses each with
+// compress_huffman() into an object from one of a few slab
+// caches of different sizes. The PTE of a swapped-out page
+// keeps its flags, but has PTE_V clear, PTE_SWAP set and the
+// number of the page's slot in place of its physical page
+// number; vmfault() brings the page back.
+//
+// The hardware sets PTE_A on each use of a page. reclaim()
+// goes round the processes' pages like a clock hand,
+// clearing PTE_A, and takes only pages whose PTE_A is still
+// clear the next time round. Pages that anything else shares
+// (see kref()) stay, as do pages that don't compress well.
+//
+// A process's pages are only swapped out while it is not
+// running, since another cpu's TLB may hold its PTEs, or by
+// the process itself from inside kalloc(); so never those of
+// a process with threads. Kernel code that uses a user page
+// through its physical address does so with the page
+// table's lock held (see copyout()), so that it can't be
+// preempted, or call kalloc(), while the page is in use.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "slab.h"
+#include "proc.h"
+#include "fs.h"
+#include "defs.h"
+
+#define PTE2SLOT(pte) ((int)((pte) >> 10))
+#define SLOT2PTE(s, pte) (((uint64)(s) << 10) | (PTE_FLAGS(pte) & ~PTE_V) | PTE_SWAP)
+
+#define ZRESERVE 4  // pages kept so the pool can grow when none are free
+
+// object sizes; each fits two or more to a slab.
+static uint zsize[] = { 128, 256, 512, 1008, 1344, 2024 };
+#define NZCLASS NELEM(zsize)
+
+struct zslot {
+  char *data;                // compressed page, 0 if the slot is free
+  ushort len;
+  uchar cls;                 // zsize[] index
+  int next;                  // free list
+};
+
+struct {
+  struct spinlock lock;      // protects free and the slots' next
+  struct slabcache cache[NZCLASS];
+  struct zslot slot[NSWAPSLOT];
+  int free;                  // first free slot, or -1
+} swap;
+
+struct {
+  struct spinlock lock;      // one reclaim() at a time
+  char buf[PGSIZE];          // compress_huffman() output
+  int hand;                  // proc[] index
+  uint64 va;                 // next page of proc[hand] to look at
+  void *reserve[ZRESERVE];
+  int nreserve;
+} reclaimer;
+
+extern struct proc proc[NPROC];
+
+void
+swapinit(void)
+{
+  int i;
+
+  initlock(&swap.lock, "swap");
+  initlock(&reclaimer.lock, "reclaim");
+  for(i = 0; i < NZCLASS; i++)
+    slabinit(&swap.cache[i], "zpage", zsize[i], 0);
+  for(i = 0; i < NSWAPSLOT; i++)
+    swap.slot[i].next = i + 1 < NSWAPSLOT ? i + 1 : -1;
+  swap.free = 0;
+  while(reclaimer.nreserve < ZRESERVE)
+    reclaimer.reserve[reclaimer.nreserve++] = kalloc();
+}
+
+// Store len bytes of compressed page in a new slot.
+// Returns the slot number, or -1.
+static int
+slotalloc(char *src, int len)
+{
+  char *data;
+  int c, s;
+
+  for(c = 0; zsize[c] < len; c++)
+    ;
+  if((data = slaballoc(&swap.cache[c])) == 0)
+    return -1;
+  acquire(&swap.lock);
+  if((s = swap.free) >= 0)
+    swap.free = swap.slot[s].next;
+  release(&swap.lock);
+  if(s < 0){
+    slabfree(&swap.cache[c], data);
+    return -1;
+  }
+  memmove(data, src, len);
+  swap.slot[s].data = data;
+  swap.slot[s].len = len;
+  swap.slot[s].cls = c;
+  return s;
+}
+
+static void
+slotfree(int s)
+{
+  struct zslot *z = &swap.slot[s];
+
+  if(s < 0 || s >= NSWAPSLOT || z->data == 0)
+    panic("slotfree");
+  slabfree(&swap.cache[z->cls], z->data);
+  z->data = 0;
+  acquire(&swap.lock);
+  z->next = swap.free;
+  swap.free = s;
+  release(&swap.lock);
+}
+
+// Swap out the page that *pte maps, if nothing else shares
+// it and it compresses well enough.
+// Returns 1 if it did.
+// Caller must hold reclaimer.lock.
+static int
+swapout(pte_t *pte)
+{
+  char *pa = (char*)PTE2PA(*pte);
+  int len, s;
+
+  if(krefs(pa) != 1)
+    return 0;
+  len = compress_huffman(pa, PGSIZE, reclaimer.buf, zsize[NZCLASS-1]);
+  if(len < 0 || (s = slotalloc(reclaimer.buf, len)) < 0)
+    return 0;
+  *pte = SLOT2PTE(s, *pte);
+  kfree(pa);
+  return 1;
+}
+
+// Bring back the swapped-out page that *pte refers to,
+// into page mem.
+// Caller must hold the page table's lock.
+void
+swapin(pte_t *pte, char *mem)
+{
+  struct zslot *z;
+  int s;
+
+  s = PTE2SLOT(*pte);
+  z = &swap.slot[s];
+  if(decompress_huffman(z->data, z->len, mem, PGSIZE) != PGSIZE)
+    panic("swapin");
+  *pte = PA2PTE(mem) | (PTE_FLAGS(*pte) & ~PTE_SWAP) | PTE_V;
+  slotfree(s);
+}
+
+// Return a swapped-out PTE referring to a copy of the page
+// that the swapped-out pte refers to, or 0.
+pte_t
+swapdup(pte_t pte)
+{
+  struct zslot *z = &swap.slot[PTE2SLOT(pte)];
+  int s;
+
+  if((s = slotalloc(z->data, z->len)) < 0)
+    return 0;
+  return SLOT2PTE(s, pte);
+}
+
+// Free the slot of a swapped-out PTE.
+void
+swapfree(pte_t pte)
+{
+  slotfree(PTE2SLOT(pte));
+}
+
+// Try to free n pages.
+// Returns the number freed.
+int
+reclaim(int n)
+{
+  struct proc *p;
+  pte_t *pte;
+  int freed, visits;
+
+  if((freed = pcshrink(n)) >= n)
+    return freed;
+
+  acquire(&reclaimer.lock);
+  // the pool, and compress_huffman(), may need pages.
+  while(reclaimer.nreserve > 0)
+    kfree(reclaimer.reserve[--reclaimer.nreserve]);
+  // twice round: pages used since the hand last passed
+  // get PTE_A cleared on the first.
+  for(visits = 0; freed < n && visits <= 2*NPROC; visits++){
+    p = &proc[reclaimer.hand];
+    acquire(&p->lock);
+    if((p->state == SLEEPING || p->state == RUNNABLE || p == myproc()) &&
+       p->leader == p && p->nthread == 0){
+      for(; freed < n && reclaimer.va < p->sz; reclaimer.va += PGSIZE){
+        if((pte = walk(p->pagetable, reclaimer.va, 0)) == 0){
+          // no page-table page for the rest of this megapage.
+          reclaimer.va |= LEVELSIZE(1) - PGSIZE;
+          continue;
+        }
+        if((*pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U))
+          continue;
+        if(*pte & PTE_A)
+          *pte &= ~PTE_A;
+        else
+          freed += swapout(pte);
+      }
+    }
+    release(&p->lock);
+    if(freed < n){
+      reclaimer.hand = (reclaimer.hand + 1) % NPROC;
+      reclaimer.va = 0;
+    }
+  }
+  // refill the reserve, unless that would leave the caller short.
+  while(freed > ZRESERVE && reclaimer.nreserve < ZRESERVE &&
+        (reclaimer.reserve[reclaimer.nreserve] = kalloc()) != 0)
+    reclaimer.nreserve++;
+  release(&reclaimer.lock);
+  return freed;
+}
@@ -20,3 +20,12 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_nice   22
+#define SYS_nanosleep 23
+#define SYS_setaffinity 24
+#define SYS_mmap   25
+#define SYS_munmap 26
+#define SYS_splice 27
+#define SYS_futex  28
+#define SYS_clone  29
+#define SYS_join   30
@@ -8,6 +8,7 @@
 #include "riscv.h"
 #include "defs.h"
 #include "param.h"
+#include "memlayout.h"
 #include "stat.h"
 #include "spinlock.h"
 #include "proc.h"
@@ -25,7 +26,7 @@ argfd(int n, int *pfd, struct file **pf)
   struct file *f;
 
   argint(n, &fd);
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if(fd < 0 || fd >= NOFILE || (f=myproc()->leader->ofile[fd]) == 0)
     return -1;
   if(pfd)
     *pfd = fd;
@@ -40,14 +41,18 @@ static int
 fdalloc(struct file *f)
 {
   int fd;
-  struct proc *p = myproc();
+  struct proc *p = myproc()->leader;
 
+  // threads may be allocating descriptors too.
+  acquire(&p->lock);
   for(fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd] == 0){
       p->ofile[fd] = f;
+      release(&p->lock);
       return fd;
     }
   }
+  release(&p->lock);
   return -1;
 }
 
@@ -76,6 +81,7 @@ sys_read(void)
   argint(2, &n);
   if(argfd(0, 0, &f) < 0)
     return -1;
+  uvmtouch(myproc()->pagetable, p, n);
   return fileread(f, p, n);
 }
 
@@ -91,6 +97,7 @@ sys_write(void)
   if(argfd(0, 0, &f) < 0)
     return -1;
 
+  uvmtouch(myproc()->pagetable, p, n);
   return filewrite(f, p, n);
 }
 
@@ -102,7 +109,7 @@ sys_close(void)
 
   if(argfd(0, &fd, &f) < 0)
     return -1;
-  myproc()->ofile[fd] = 0;
+  myproc()->leader->ofile[fd] = 0;
   fileclose(f);
   return 0;
 }
@@ -262,7 +269,7 @@ create(char *path, short type, short major, short minor)
     return 0;
   }
 
-  if((ip = ialloc(dp->dev, type)) == 0){
+  if((ip = ialloc(dp->dev, type, dp->inum)) == 0){
     iunlockput(dp);
     return 0;
   }
@@ -411,7 +418,7 @@ sys_chdir(void)
 {
   char path[MAXPATH];
   struct inode *ip;
-  struct proc *p = myproc();
+  struct proc *p = myproc()->leader;
   
   begin_op();
   if(argstr(0, path, MAXPATH) < 0 || (ip = namei(path)) == 0){
@@ -480,7 +487,7 @@ sys_pipe(void)
   uint64 fdarray; // user pointer to array of two integers
   struct file *rf, *wf;
   int fd0, fd1;
-  struct proc *p = myproc();
+  struct proc *p = myproc()->leader;
 
   argaddr(0, &fdarray);
   if(pipealloc(&rf, &wf) < 0)
@@ -503,3 +510,104 @@ sys_pipe(void)
   }
   return 0;
 }
+
+// Map len bytes of the file open as fd, from page-aligned
+// offset off, into the caller's memory, placing the mapping
+// below any others. addr is only a hint, and is ignored.
+// Pages are read in as they are touched; with MAP_SHARED,
+// processes mapping the file share its pages, and changes
+// go back to the file at munmap() or exit.
+// With MAP_ANON, the memory is zero-filled and fd and off
+// are ignored; MAP_SHARED|MAP_ANON memory is allocated at
+// once, so that children made by fork() share all of it.
+uint64
+sys_mmap(void)
+{
+  uint64 len, off, va, a;
+  int prot, flags, anon, perm;
+  struct file *f;
+  struct proc *p = myproc()->leader;
+  struct vma *v;
+
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argaddr(5, &off);
+  anon = flags & MAP_ANON;
+  flags &= ~MAP_ANON;
+  f = 0;
+  if(!anon && argfd(4, 0, &f) < 0)
+    return -1;
+  if(len == 0 || len >= USERTOP || off % PGSIZE != 0)
+    return -1;
+  if((prot & (PROT_READ|PROT_WRITE|PROT_EXEC)) == 0)
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if(f && (f->type != FD_INODE || f->ip->type != T_FILE || !f->readable))
+    return -1;
+  if(f && flags == MAP_SHARED && (prot & PROT_WRITE) && !f->writable)
+    return -1;
+
+  len = PGROUNDUP(len);
+  va = vmabase(p);
+  if(va - PGROUNDUP(p->sz) < len)
+    return -1;
+  va -= len;
+  for(v = p->vma; v < &p->vma[NVMA] && v->end; v++)
+    ;
+  if(v == &p->vma[NVMA])
+    return -1;
+
+  perm = PTE_U;
+  if(prot & (PROT_READ|PROT_WRITE))
+    perm |= PTE_R;  // the hardware has no write-only pages
+  if(prot & PROT_WRITE)
+    perm |= PTE_W;
+  if(prot & PROT_EXEC)
+    perm |= PTE_X;
+  v->ip = f ? idup(f->ip) : 0;
+  v->start = va;
+  v->end = va + len;
+  v->off = off;
+  v->filesz = f ? len : 0;
+  v->perm = perm;
+  v->flags = flags;
+  if(anon && flags == MAP_SHARED){
+    for(a = va; a < va + len; a += PGSIZE){
+      if(vmfault(p->pagetable, a) == 0){
+        vmaunmap(va, va + len);
+        return -1;
+      }
+    }
+  }
+  return va;
+}
+
+// Remove the mappings between page-aligned addr and
+// addr+len, writing changes to MAP_SHARED ones back.
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  if(addr % PGSIZE != 0 || len == 0 || addr + len < addr || addr + len > USERTOP)
+    return -1;
+  return vmaunmap(addr, PGROUNDUP(addr + len));
+}
+
+// Move up to n bytes from one file descriptor to another,
+// one of them a pipe, inside the kernel.
+uint64
+sys_splice(void)
+{
+  struct file *in, *out;
+  int n;
+
+  argint(2, &n);
+  if(argfd(0, 0, &in) < 0 || argfd(1, 0, &out) < 0)
+    return -1;
+  return filesplice(in, out, n);
+}
@@ -5,6 +5,9 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "fcntl.h"
+
+#define TICK (TIMEBASE / 10)  // unit of sleep() and uptime()
 
 uint64
 sys_exit(void)
@@ -32,42 +35,45 @@ sys_wait(void)
 {
   uint64 p;
   argaddr(0, &p);
+  // wait() copies out the status with spinlocks held.
+  uvmtouch(myproc()->pagetable, p, sizeof(int));
   return wait(p);
 }
 
 uint64
 sys_sbrk(void)
 {
-  uint64 addr;
   int n;
 
   argint(0, &n);
-  addr = myproc()->sz;
-  if(growproc(n) < 0)
-    return -1;
-  return addr;
+  return growproc(n);
 }
 
 uint64
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
 
   argint(0, &n);
   if(n < 0)
     n = 0;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(killed(myproc())){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
-  return 0;
+  return timersleep(r_time() + (uint64)n * TICK);
+}
+
+// sleep for at least ns nanoseconds.
+uint64
+sys_nanosleep(void)
+{
+  uint64 ns, n, now;
+
+  argaddr(0, &ns);
+  // round up to whole time CSR cycles, and don't let a huge
+  // ns wrap the deadline around into the past.
+  n = ns / (1000000000 / TIMEBASE) + (ns % (1000000000 / TIMEBASE) != 0);
+  now = r_time();
+  if(n > ~0ULL - now)
+    return timersleep(~0ULL);
+  return timersleep(now + n);
 }
 
 uint64
@@ -79,15 +85,74 @@ sys_kill(void)
   return kill(pid);
 }
 
-// return how many clock tick interrupts have occurred
-// since start.
+uint64
+sys_nice(void)
+{
+  int incr;
+
+  argint(0, &incr);
+  return nice(incr);
+}
+
+uint64
+sys_setaffinity(void)
+{
+  int pid, mask;
+
+  argint(0, &pid);
+  argint(1, &mask);
+  return setaffinity(pid, mask);
+}
+
+// return how many ticks (tenths of a second) have
+// passed since start.
 uint64
 sys_uptime(void)
 {
-  uint xticks;
+  return r_time() / TICK;
+}
+
+// FUTEX_WAIT: sleep while the int at addr holds val.
+// FUTEX_WAKE: wake up to val processes waiting on addr.
+uint64
+sys_futex(void)
+{
+  uint64 addr;
+  int op, val;
+
+  argaddr(0, &addr);
+  argint(1, &op);
+  argint(2, &val);
+  if(op == FUTEX_WAIT)
+    return futexwait(addr, val);
+  if(op == FUTEX_WAKE)
+    return futexwake(addr, val);
+  return -1;
+}
+
+// start a thread running fn(arg) on the given stack, with
+// tp set to tls.
+uint64
+sys_clone(void)
+{
+  uint64 fn, arg, stack, tls;
+
+  argaddr(0, &fn);
+  argaddr(1, &arg);
+  argaddr(2, &stack);
+  argaddr(3, &tls);
+  return clone(fn, arg, stack, tls);
+}
+
+uint64
+sys_join(void)
+{
+  int tid;
+  uint64 p;
 
-  acquire(&tickslock);
-  xticks = ticks;
-  release(&tickslock);
-  return xticks;
+  argint(0, &tid);
+  argaddr(1, &p);
+  // join() copies out the status with spinlocks held.
+  uvmtouch(myproc()->pagetable, p, sizeof(int));
+  return join(tid, p);
 }
@@ -0,0 +1,159 @@
+// Timers.
+//
+// Each CPU keeps a min-heap of the processes sleeping on it
+// until a deadline, ordered by p->wakeat (in time CSR units).
+// The timer interrupt is one-shot: after each interrupt,
+// timerintr() programs stimecmp for the earliest of
+//  - the first deadline in this CPU's heap,
+//  - the end of a time slice, if a process is running, and
+//  - IDLEPOLL from now, if the CPU is idle.
+// Without inter-processor interrupts, an idle CPU has to wake
+// up now and then to look for work to steal.
+//
+// The invariant is that stimecmp is never later than the first
+// deadline in the CPU's heap, so adding a timer only has to
+// move stimecmp earlier.
+//
+// Lock order: a heap's lock, then the locks taken by wakeup().
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+struct timers {
+  struct spinlock lock;
+  struct proc *heap[NPROC];  // min-heap on p->wakeat
+  int n;
+} timers[NCPU];
+
+void
+timersinit(void)
+{
+  struct timers *t;
+
+  for(t = timers; t < &timers[NCPU]; t++)
+    initlock(&t->lock, "timers");
+}
+
+// Put heap entry i in place and record its index.
+static void
+hset(struct timers *t, int i, struct proc *p)
+{
+  t->heap[i] = p;
+  p->tidx = i;
+}
+
+// Restore heap order around entry i.
+static void
+hfix(struct timers *t, int i)
+{
+  struct proc *p = t->heap[i];
+  int c;
+
+  while(i > 0 && p->wakeat < t->heap[(i-1)/2]->wakeat){
+    hset(t, i, t->heap[(i-1)/2]);
+    i = (i-1)/2;
+  }
+  for(;;){
+    c = 2*i + 1;
+    if(c >= t->n)
+      break;
+    if(c+1 < t->n && t->heap[c+1]->wakeat < t->heap[c]->wakeat)
+      c++;
+    if(p->wakeat <= t->heap[c]->wakeat)
+      break;
+    hset(t, i, t->heap[c]);
+    i = c;
+  }
+  hset(t, i, p);
+}
+
+// Remove p from heap t.
+// Caller must hold t->lock.
+static void
+hremove(struct timers *t, struct proc *p)
+{
+  int i = p->tidx;
+
+  p->tidx = -1;
+  p->tcpu = -1;
+  if(--t->n > i){
+    hset(t, i, t->heap[t->n]);
+    hfix(t, i);
+  }
+}
+
+// Sleep until r_time() reaches deadline.
+// Returns 0, or -1 if the process was killed.
+int
+timersleep(uint64 deadline)
+{
+  struct proc *p = myproc();
+  struct timers *t;
+
+  while(r_time() < deadline){
+    if(killed(p))
+      return -1;
+
+    // Interrupts stay off from here until sleep(), so the
+    // heap is this CPU's and stimecmp below is this CPU's too.
+    push_off();
+    t = &timers[cpuid()];
+    acquire(&t->lock);
+    pop_off();
+
+    p->wakeat = deadline;
+    p->tcpu = t - timers;
+    p->tidx = t->n++;
+    t->heap[p->tidx] = p;
+    hfix(t, p->tidx);
+    if(deadline < r_stimecmp())
+      w_stimecmp(deadline);
+
+    sleep(&p->wakeat, &t->lock);
+
+    // Still queued if kill() woke us early.
+    if(p->tcpu == t - timers)
+      hremove(t, p);
+    release(&t->lock);
+  }
+  return 0;
+}
+
+// Handle a timer interrupt on this CPU: wake the processes
+// whose deadlines have passed, then ask for the next interrupt.
+void
+timerintr(void)
+{
+  struct timers *t = &timers[cpuid()];
+  struct proc *p;
+  uint64 next;
+
+  acquire(&t->lock);
+  while(t->n > 0 && (p = t->heap[0])->wakeat <= r_time()){
+    hremove(t, p);
+    wakeup(&p->wakeat);
+  }
+
+  next = r_time() + (mycpu()->proc ? TIMESLICE : IDLEPOLL);
+  if(t->n > 0 && t->heap[0]->wakeat < next)
+    next = t->heap[0]->wakeat;
+  // this also clears the interrupt request.
+  w_stimecmp(next);
+  release(&t->lock);
+}
+
+// Make sure this CPU's timer interrupts by the end of a time
+// slice, for a process about to run. Interrupts must be off.
+void
+timerslice(void)
+{
+  uint64 next = r_time() + TIMESLICE;
+
+  if(next < r_stimecmp())
+    w_stimecmp(next);
+}
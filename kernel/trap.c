@@ -6,9 +6,6 @@
 #include "proc.h"
 #include "defs.h"
 
-struct spinlock tickslock;
-uint ticks;
-
 extern char trampoline[], uservec[], userret[];
 
 // in kernelvec.S, calls kerneltrap().
@@ -19,7 +16,7 @@ extern int devintr();
 void
 trapinit(void)
 {
-  initlock(&tickslock, "time");
+  timersinit();
 }
 
 // set up to take exceptions and traps while in the kernel.
@@ -45,6 +42,9 @@ usertrap(void)
   // since we're now in the kernel.
   w_stvec((uint64)kernelvec);
 
+  // uservec flushed this cpu's TLB; see tlbshootdown().
+  __atomic_add_fetch(&mycpu()->ucross, 1, __ATOMIC_SEQ_CST);
+
   struct proc *p = myproc();
   
   // save user program counter.
@@ -67,6 +67,20 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if(r_scause() == 12 || r_scause() == 13 || r_scause() == 15){
+    // page fault. reading a page in from a file may sleep.
+    // another thread may have mapped the page meanwhile.
+    uint64 va = r_stval();
+    int store = r_scause() == 15;
+    int perm = store ? PTE_W : r_scause() == 12 ? PTE_X : PTE_R;
+    intr_on();
+    if(vmfault(p->pagetable, va) == 0 &&
+       (!store || uvmcow(p->pagetable, va) != 0) &&
+       !uvmallows(p->pagetable, va, perm)){
+      printf("usertrap(): page fault va=0x%lx pid=%d\n", va, p->pid);
+      printf("            sepc=0x%lx\n", p->trapframe->epc);
+      setkilled(p);
+    }
   } else {
     printf("usertrap(): unexpected scause 0x%lx pid=%d\n", r_scause(), p->pid);
     printf("            sepc=0x%lx stval=0x%lx\n", r_sepc(), r_stval());
@@ -76,9 +90,9 @@ usertrap(void)
   if(killed(p))
     exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
+  // maybe give up the CPU if this is a timer interrupt.
   if(which_dev == 2)
-    yield();
+    schedtick();
 
   usertrapret();
 }
@@ -96,6 +110,10 @@ usertrapret(void)
   // we're back in user space, where usertrap() is correct.
   intr_off();
 
+  // userret will flush this cpu's TLB after tlbshootdown()
+  // can see that it's heading for user space.
+  __atomic_add_fetch(&mycpu()->ucross, 1, __ATOMIC_SEQ_CST);
+
   // send syscalls, interrupts, and exceptions to uservec in trampoline.S
   uint64 trampoline_uservec = TRAMPOLINE + (uservec - trampoline);
   w_stvec(trampoline_uservec);
@@ -123,10 +141,11 @@ usertrapret(void)
   uint64 satp = MAKE_SATP(p->pagetable);
 
   // jump to userret in trampoline.S at the top of memory, which 
-  // switches to the user page table, restores user registers,
-  // and switches to user mode with sret.
+  // switches to the user page table, restores user registers
+  // from the trapframe at p->tfva, and switches to user mode
+  // with sret.
   uint64 trampoline_userret = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64))trampoline_userret)(satp);
+  ((void (*)(uint64, uint64))trampoline_userret)(satp, p->tfva);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -150,9 +169,9 @@ kerneltrap()
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
+  // maybe give up the CPU if this is a timer interrupt.
   if(which_dev == 2 && myproc() != 0)
-    yield();
+    schedtick();
 
   // the yield() may have caused some traps to occur,
   // so restore trap registers for use by kernelvec.S's sepc instruction.
@@ -163,17 +182,7 @@ kerneltrap()
 void
 clockintr()
 {
-  if(cpuid() == 0){
-    acquire(&tickslock);
-    ticks++;
-    wakeup(&ticks);
-    release(&tickslock);
-  }
-
-  // ask for the next timer interrupt. this also clears
-  // the interrupt request. 1000000 is about a tenth
-  // of a second.
-  w_stimecmp(r_time() + 1000000);
+  timerintr();
 }
 
 // check if it's an external interrupt or software interrupt,
@@ -211,6 +220,12 @@ devintr()
     // timer interrupt.
     clockintr();
     return 2;
+  } else if(scause == 0x8000000000000001L){
+    // software interrupt from another hart, passed on by
+    // ipivec in kernelvec.S. trapping from user space has
+    // done what tlbshootdown() wanted.
+    w_sip(r_sip() & ~2);
+    return 1;
   } else {
     return 0;
   }
@@ -46,8 +46,9 @@
 #define VIRTIO_RING_F_EVENT_IDX     29
 
 // this many virtio descriptors.
-// must be a power of two.
-#define NUM 8
+// must be a power of two, and at least NBATCH+2
+// so that a whole multi-block request fits.
+#define NUM 32
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -196,12 +196,11 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_descs(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -212,27 +211,32 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// queue one request that transfers the n buffers in b[],
+// which must hold consecutive blocks. caller holds
+// disk.vdisk_lock and tells the device about it.
+static void
+virtio_disk_queue(struct buf **b, int n, int write)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
+  uint64 sector = b[0]->blockno * (b[0]->size / 512);
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // a descriptor for type/reserved/sector, then the data, then
+  // a 1-byte status result. the data may be split across several
+  // descriptors, so a run of n blocks takes n+2 descriptors.
 
-  // allocate the three descriptors.
-  int idx[3];
+  // allocate the descriptors.
+  int idx[NBATCH+2];
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(alloc_descs(idx, n+2) == 0) {
       break;
     }
+    // requests queued earlier by this caller may be holding the
+    // descriptors we need; make sure the device has seen them.
+    *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0;
     sleep(&disk.free[0], &disk.vdisk_lock);
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -249,24 +253,27 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(int i = 0; i < n; i++){
+    disk.desc[idx[i+1]].addr = (uint64) b[i]->data;
+    disk.desc[idx[i+1]].len = b[i]->size;
+    if(write)
+      disk.desc[idx[i+1]].flags = 0; // device reads b->data
+    else
+      disk.desc[idx[i+1]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    disk.desc[idx[i+1]].flags |= VRING_DESC_F_NEXT;
+    disk.desc[idx[i+1]].next = idx[i+2];
+  }
 
   disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  disk.desc[idx[n+1]].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[idx[n+1]].len = 1;
+  disk.desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[idx[n+1]].next = 0;
 
   // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  // the first buffer of the run stands for all of them.
+  b[0]->disk = 1;
+  disk.info[idx[0]].b = b[0];
 
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
@@ -275,22 +282,47 @@ virtio_disk_rw(struct buf *b, int write)
 
   // tell the device another avail ring entry is available.
   disk.avail->idx += 1; // not % NUM ...
+}
+
+// read or write the n locked buffers in b[].
+// each run of consecutive block numbers becomes a single
+// multi-block request, and all of the requests are handed
+// to the device before waiting for any of them.
+void
+virtio_disk_rwv(struct buf **b, int n, int write)
+{
+  int i, j;
+
+  acquire(&disk.vdisk_lock);
+
+  for(i = 0; i < n; i = j){
+    for(j = i+1; j < n && j-i < NBATCH; j++){
+      if(b[j]->blockno != b[j-1]->blockno + 1)
+        break;
+    }
+    virtio_disk_queue(b+i, j-i, write);
+  }
 
   __sync_synchronize();
 
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+  // Wait for virtio_disk_intr() to say the requests have finished.
+  for(i = 0; i < n; i++){
+    while(b[i]->disk == 1) {
+      sleep(b[i], &disk.vdisk_lock);
+    }
   }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
-
   release(&disk.vdisk_lock);
 }
 
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_rwv(&b, 1, write);
+}
+
 void
 virtio_disk_intr()
 {
@@ -320,6 +352,12 @@ virtio_disk_intr()
     b->disk = 0;   // disk is done with buf
     wakeup(b);
 
+    // free the chain here rather than in the waiter, so that
+    // a caller queueing several requests can't starve itself
+    // of descriptors.
+    disk.info[id].b = 0;
+    free_chain(id);
+
     disk.used_idx += 1;
   }
 
@@ -5,6 +5,11 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "proc.h"
+#include "fcntl.h"
 
 /*
  * the kernel's page table.
@@ -15,6 +20,17 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+// Threads share their process's page table, so a user page
+// table is changed, and the pages it maps are used through
+// their physical addresses, with its lock held: one of a
+// few, picked by hashing. Holding it also keeps interrupts
+// off, so that the pages can't be swapped out meanwhile
+// (see swap.c).
+#define NPTLOCK 13
+#define PTLOCK(pt) (&ptlock[(uint64)(pt) / PGSIZE % NPTLOCK])
+
+static struct spinlock ptlock[NPTLOCK];
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
@@ -33,6 +49,9 @@ kvmmake(void)
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x4000000, PTE_R | PTE_W);
 
+  // CLINT, to interrupt other harts; see tlbshootdown().
+  kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // map kernel text executable and read-only.
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
@@ -53,6 +72,10 @@ kvmmake(void)
 void
 kvminit(void)
 {
+  int i;
+
+  for(i = 0; i < NPTLOCK; i++)
+    initlock(&ptlock[i], "pagetable");
   kernel_pagetable = kvmmake();
 }
 
@@ -71,8 +94,10 @@ kvminithart()
 }
 
 // Return the address of the PTE in page table pagetable
-// that corresponds to virtual address va.  If alloc!=0,
-// create any required page-table pages.
+// that corresponds to virtual address va at the given level,
+// 0 for a 4096-byte page. If alloc!=0, create any required
+// page-table pages. If va lies in a superpage mapped above
+// that level, return the superpage's PTE.
 //
 // The risc-v Sv39 scheme has three levels of page-table
 // pages. A page-table page contains 512 64-bit PTEs.
@@ -82,15 +107,17 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
-pte_t *
-walk(pagetable_t pagetable, uint64 va, int alloc)
+static pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int level, int alloc)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  for(int l = 2; l > level; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
     if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte))
+        return pte;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
       if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
@@ -99,7 +126,34 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(level, va)];
+}
+
+// Return the address of the PTE for the page holding va.
+// User page tables only have 4096-byte pages.
+pte_t *
+walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  return walklevel(pagetable, va, 0, alloc);
+}
+
+// Return the highest level at which a single leaf PTE can map
+// va to pa, given that size bytes are left to map and that
+// the PTE there must not already point to a page-table page.
+static int
+leaflevel(pagetable_t pagetable, uint64 va, uint64 pa, uint64 size)
+{
+  pte_t *pte;
+  int level;
+
+  for(level = 2; level > 0; level--){
+    if(va % LEVELSIZE(level) || pa % LEVELSIZE(level) || size < LEVELSIZE(level))
+      continue;
+    pte = walklevel(pagetable, va, level, 0);
+    if(pte == 0 || (*pte & PTE_V) == 0)
+      return level;
+  }
+  return 0;
 }
 
 // Look up a virtual address, return the physical address,
@@ -136,15 +190,17 @@ kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
-// physical addresses starting at pa.
+// physical addresses starting at pa, using megapages and
+// gigapages where va, pa and size allow.
 // va and size MUST be page-aligned.
 // Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
-  uint64 a, last;
+  uint64 a, end;
   pte_t *pte;
+  int level;
 
   if((va % PGSIZE) != 0)
     panic("mappages: va not aligned");
@@ -155,46 +211,62 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   if(size == 0)
     panic("mappages: size");
   
-  a = va;
-  last = va + size - PGSIZE;
-  for(;;){
-    if((pte = walk(pagetable, a, 1)) == 0)
+  end = va + size;
+  for(a = va; a < end; a += LEVELSIZE(level)){
+    level = leaflevel(pagetable, a, pa, end - a);
+    if((pte = walklevel(pagetable, a, level, 1)) == 0)
       return -1;
     if(*pte & PTE_V)
       panic("mappages: remap");
     *pte = PA2PTE(pa) | perm | PTE_V;
-    if(a == last)
-      break;
-    a += PGSIZE;
-    pa += PGSIZE;
+    pa += LEVELSIZE(level);
   }
   return 0;
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
-// Optionally free the physical memory.
+// page-aligned. Pages that were never touched (see vmfault)
+// are skipped. Optionally free the physical memory, or the
+// swap slots of swapped-out pages. Pages are freed a batch
+// at a time, once tlbshootdown() has made sure that other
+// threads can't reach them any more.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, pa[32];
   pte_t *pte;
+  int n;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
+  n = 0;
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
     if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
-    if(PTE_FLAGS(*pte) == PTE_V)
-      panic("uvmunmap: not a leaf");
-    if(do_free){
-      uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
+      continue;
+    acquire(PTLOCK(pagetable));
+    if(*pte & PTE_SWAP){
+      if(do_free)
+        swapfree(*pte);
+      *pte = 0;
+    } else if(*pte & PTE_V){
+      if(PTE_FLAGS(*pte) == PTE_V)
+        panic("uvmunmap: not a leaf");
+      if(do_free)
+        pa[n++] = PTE2PA(*pte);
+      *pte = 0;
+    }
+    release(PTLOCK(pagetable));
+    if(n == NELEM(pa)){
+      tlbshootdown(pagetable);
+      while(n > 0)
+        kfree((void*)pa[--n]);
     }
-    *pte = 0;
+  }
+  if(n > 0){
+    tlbshootdown(pagetable);
+    while(n > 0)
+      kfree((void*)pa[--n]);
   }
 }
 
@@ -303,39 +375,494 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Copy the mappings between start and end of a parent's
+// page table to a child's. Pages are shared: copy-on-write
+// unless shared is set. If copy is set, because threads may
+// be using old on other cpus, whose TLBs would keep the
+// pages writable, writable pages are copied at once instead
+// of becoming copy-on-write.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
-int
-uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+static int
+copyrange(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int shared, int copy)
 {
-  pte_t *pte;
+  pte_t *pte, *npte;
   uint64 pa, i;
   uint flags;
   char *mem;
 
-  for(i = 0; i < sz; i += PGSIZE){
+  for(i = start; i < end; i += PGSIZE){
     if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;
+    if(*pte & PTE_SWAP){
+      // the child gets its own compressed copy.
+      if((npte = walk(new, i, 1)) == 0 || (*npte = swapdup(*pte)) == 0)
+        goto err;
+      continue;
+    }
+    // kalloc() can't be called with the lock held.
+    mem = 0;
+    if(copy && !shared && (mem = kalloc()) == 0)
+      goto err;
+    // so that the page can't be swapped out before it has
+    // the child's reference.
+    acquire(PTLOCK(old));
+    if((*pte & PTE_V) == 0){
+      release(PTLOCK(old));
+      if(mem)
+        kfree(mem);
+      continue;  // not touched yet
+    }
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
+    if(mem && (*pte & PTE_W)){
+      memmove(mem, (char*)pa, PGSIZE);
+      pa = (uint64)mem;
+      mem = 0;
+    } else {
+      // share the page; a writable one becomes copy-on-write
+      // in both parent and child.
+      if((*pte & PTE_W) && !shared){
+        *pte = (*pte & ~PTE_W) | PTE_COW;
+        flags = PTE_FLAGS(*pte);
+      }
+      kref((void*)pa);
+    }
+    release(PTLOCK(old));
+    if(mem)
       kfree(mem);
+    if(mappages(new, i, PGSIZE, pa, flags) != 0){
+      kfree((void*)pa);
       goto err;
     }
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
+  return -1;
+}
+
+// Given a parent process's page table, copy
+// its memory into a child's page table.
+// Copies both the page table and the
+// physical memory, at once if copy is set (see copyrange()).
+// returns 0 on success, -1 on failure.
+// frees any allocated pages on failure.
+int
+uvmcopy(pagetable_t old, pagetable_t new, uint64 sz, int copy)
+{
+  return copyrange(old, new, 0, sz, 0, copy);
+}
+
+// Copy the pages of the mmap()ed regions in vma[NVMA] from
+// a parent's page table to a child's.
+// returns 0 on success, -1 on failure.
+// frees any allocated pages on failure.
+int
+vmacopy(pagetable_t old, pagetable_t new, struct vma *vma, int copy)
+{
+  struct vma *v, *u;
+
+  for(v = vma; v < &vma[NVMA]; v++){
+    if(v->end == 0 || v->flags == 0)
+      continue;
+    if(copyrange(old, new, v->start, v->end, v->flags == MAP_SHARED, copy) < 0){
+      for(u = vma; u < v; u++)
+        if(u->end && u->flags)
+          uvmunmap(new, u->start, (u->end - u->start) / PGSIZE, 1);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Map page pa at va in a page table that threads may be
+// using, such as a thread's trapframe.
+// Returns 0 on success, -1 if out of memory.
+int
+uvmmap(pagetable_t pagetable, uint64 va, uint64 pa, int perm)
+{
+  int r;
+
+  acquire(PTLOCK(pagetable));
+  r = mappages(pagetable, va, PGSIZE, pa, perm);
+  release(PTLOCK(pagetable));
+  return r;
+}
+
+// Map page pa at va with permissions perm, after a fault,
+// unless another thread sharing the page table has mapped
+// va meanwhile.
+// Returns pa, or 0, having freed pa, if it didn't map it.
+static uint64
+mapfault(pagetable_t pagetable, uint64 va, uint64 pa, int perm)
+{
+  pte_t *pte;
+  int ok;
+
+  acquire(PTLOCK(pagetable));
+  pte = walk(pagetable, va, 0);
+  ok = (pte == 0 || (*pte & (PTE_V|PTE_SWAP)) == 0) &&
+       mappages(pagetable, va, PGSIZE, pa, perm) == 0;
+  release(PTLOCK(pagetable));
+  if(!ok){
+    kfree((void*)pa);
+    return 0;
+  }
+  return pa;
+}
+
+// Map page va of file-backed region v from the page cache.
+// Whole pages of file data are shared, copy-on-write if v
+// is writable and not MAP_SHARED; the page holding the end
+// of the data gets a private copy with the rest zeroed.
+// Returns the physical address of the page, or 0.
+static uint64
+vmafill(pagetable_t pagetable, struct vma *v, uint64 va)
+{
+  uint64 off, pa, n;
+  int perm;
+  char *mem;
+
+  off = va - v->start;
+  perm = v->perm;
+  // the page cache may have to read the file, which can't be
+  // done with a spinlock held; see uvmtouch().
+  if(intr_get() == 0)
+    return 0;
+  if((pa = pcget(v->ip, v->off + off, v->flags == MAP_SHARED)) == 0)
+    return 0;
+  if(off + PGSIZE <= v->filesz){
+    if((perm & PTE_W) && v->flags != MAP_SHARED)
+      perm = (perm & ~PTE_W) | PTE_COW;
+    return mapfault(pagetable, va, pa, perm);
+  }
+  if((mem = kalloc()) == 0){
+    kfree((void*)pa);
+    return 0;
+  }
+  n = v->filesz - off;
+  memmove(mem, (char*)pa, n);
+  memset(mem + n, 0, PGSIZE - n);
+  kfree((void*)pa);
+  return mapfault(pagetable, va, (uint64)mem, perm);
+}
+
+// Map the page at va if it lies in the calling process's
+// memory (below p->sz, or in an mmap()ed region) but is not
+// mapped: from swap if it was swapped out, from the file if
+// it is in one of p's file-backed regions, otherwise a
+// zeroed page, since sbrk() only reserves address space.
+// Returns the physical address of the page, or 0, also if
+// another thread mapped it first.
+uint64
+vmfault(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  pte_t *pte;
+  char *mem;
+  int perm;
+
+  va = PGROUNDDOWN(va);
+  if(p == 0 || pagetable != p->pagetable)
+    return 0;
+  p = p->leader;
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end && va >= v->start && va < v->end)
+      break;
+  if(v == &p->vma[NVMA] && va >= p->sz)
+    return 0;
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V))
+    return 0;
+  if(pte && (*pte & PTE_SWAP)){
+    if((mem = kalloc()) == 0)
+      return 0;
+    acquire(PTLOCK(pagetable));
+    if(*pte & PTE_SWAP){
+      swapin(pte, mem);
+      release(PTLOCK(pagetable));
+      return (uint64)mem;
+    }
+    release(PTLOCK(pagetable));
+    kfree(mem);
+    return 0;
+  }
+  perm = PTE_R|PTE_W|PTE_U;
+  if(v < &p->vma[NVMA]){
+    if(va - v->start < v->filesz)
+      return vmafill(pagetable, v, va);
+    perm = v->perm;  // zero-filled, like bss
+  }
+  if((mem = kalloc()) == 0)
+    return 0;
+  memset(mem, 0, PGSIZE);
+  return mapfault(pagetable, va, (uint64)mem, perm);
+}
+
+// Read the int at user address va into *val, with the
+// page table's lock held so that another thread can't
+// replace the page meanwhile.
+// Returns the physical address it was read from, or 0 if
+// its page is not mapped.
+uint64
+uvmword(pagetable_t pagetable, uint64 va, int *val)
+{
+  pte_t *pte;
+  uint64 pa;
+
+  if(va >= MAXVA)
+    return 0;
+  pa = 0;
+  acquire(PTLOCK(pagetable));
+  pte = walk(pagetable, PGROUNDDOWN(va), 0);
+  if(pte && (*pte & (PTE_V|PTE_U)) == (PTE_V|PTE_U)){
+    pa = PTE2PA(*pte) + (va - PGROUNDDOWN(va));
+    *val = *(int*)pa;
+  }
+  release(PTLOCK(pagetable));
+  return pa;
+}
+
+// Return 1 if user page va is mapped with permissions perm,
+// as it may be by another thread after a fault.
+int
+uvmallows(pagetable_t pagetable, uint64 va, int perm)
+{
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    return 0;
+  pte = walk(pagetable, PGROUNDDOWN(va), 0);
+  return pte && (*pte & (PTE_V|PTE_U|perm)) == (PTE_V|PTE_U|perm);
+}
+
+// Fault in the not yet mapped file-backed pages of the
+// calling process between va and va+len, so that copyin()
+// and copyout() needn't read files when called with a
+// spinlock held.
+void
+uvmtouch(pagetable_t pagetable, uint64 va, uint64 len)
+{
+  struct proc *p = myproc()->leader;
+  struct vma *v;
+  uint64 a, end;
+
+  end = va + len < va ? MAXVA : va + len;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->ip == 0 || v->end <= va || v->start >= end)
+      continue;
+    a = PGROUNDDOWN(va > v->start ? va : v->start);
+    for(; a < end && a < v->start + v->filesz; a += PGSIZE)
+      if(walkaddr(pagetable, a) == 0)
+        vmfault(pagetable, a);
+  }
+}
+
+// Write page pa, which holds v's file data from offset
+// off, back to the file, leaving the file's size alone.
+static void
+vmawrite(struct vma *v, uint64 off, uint64 pa)
+{
+  // a few blocks per transaction; see filewrite().
+  uint64 max = ((MAXOPBLOCKS-1-1-2) / 2) * sb.bsize;
+  uint64 n, m;
+  int done;
+
+  for(n = 0, done = 0; n < PGSIZE && !done; n += m){
+    m = PGSIZE - n < max ? PGSIZE - n : max;
+    begin_op();
+    ilock(v->ip);
+    if(off + n + m >= isize(v->ip)){
+      m = off + n < v->ip->lsize ? v->ip->lsize - off - n : 0;
+      done = 1;
+    }
+    if(m > 0)
+      writei(v->ip, 0, pa + n, off + n, m);
+    iunlock(v->ip);
+    end_op();
+  }
+}
+
+// Unmap the pages of mmap()ed region v between a and b,
+// first writing those of a MAP_SHARED region that have
+// been written to back to the file.
+static void
+vmaflush(pagetable_t pagetable, struct vma *v, uint64 a, uint64 b)
+{
+  uint64 va;
+  pte_t *pte;
+
+  if(v->flags == MAP_SHARED && v->ip){
+    for(va = a; va < b; va += PGSIZE){
+      pte = walk(pagetable, va, 0);
+      if(pte && (*pte & (PTE_V|PTE_W|PTE_D)) == (PTE_V|PTE_W|PTE_D))
+        vmawrite(v, v->off + (va - v->start), PTE2PA(*pte));
+    }
+  }
+  uvmunmap(pagetable, a, (b - a) / PGSIZE, 1);
+}
+
+// Release the regions in vma[NVMA], writing back and
+// unmapping those made by mmap().
+// Must not be called inside a transaction.
+void
+vmaput(pagetable_t pagetable, struct vma *vma)
+{
+  struct vma *v;
+
+  for(v = vma; v < &vma[NVMA]; v++){
+    if(v->end){
+      if(v->flags)
+        vmaflush(pagetable, v, v->start, v->end);
+      if(v->ip){
+        begin_op();
+        iput(v->ip);
+        end_op();
+      }
+      v->ip = 0;
+      v->end = 0;
+    }
+  }
+}
+
+// Return the lowest address of p's mmap()ed regions, or
+// USERTOP if it has none. The heap grows up to it, and
+// mmap() places new regions below it.
+uint64
+vmabase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base;
+
+  base = USERTOP;
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end && v->flags && v->start < base)
+      base = v->start;
+  return base;
+}
+
+// Remove the parts of the calling process's mmap()ed
+// regions between page-aligned a and b, writing back and
+// unmapping their pages; a region that covers both sides
+// is split in two.
+// Returns 0, or -1 if there is no vma for such a split.
+int
+vmaunmap(uint64 a, uint64 b)
+{
+  struct proc *p = myproc()->leader;
+  struct vma *v, *nv;
+  uint64 lo, hi;
+
+  // find the vma for the upper part of a split first.
+  nv = 0;
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end && v->flags && v->start < a && v->end > b)
+      break;
+  if(v < &p->vma[NVMA]){
+    for(nv = p->vma; nv < &p->vma[NVMA] && nv->end; nv++)
+      ;
+    if(nv == &p->vma[NVMA])
+      return -1;
+  }
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end == 0 || v->flags == 0 || v->end <= a || v->start >= b)
+      continue;
+    lo = v->start > a ? v->start : a;
+    hi = v->end < b ? v->end : b;
+    vmaflush(p->pagetable, v, lo, hi);
+    if(lo == v->start && hi == v->end){
+      if(v->ip){
+        begin_op();
+        iput(v->ip);
+        end_op();
+      }
+      v->ip = 0;
+      v->end = 0;
+    } else if(lo == v->start){
+      v->off += hi - v->start;
+      if(v->ip)
+        v->filesz -= hi - v->start;
+      v->start = hi;
+    } else if(hi == v->end){
+      if(v->ip)
+        v->filesz -= v->end - lo;
+      v->end = lo;
+    } else {
+      *nv = *v;
+      if(v->ip){
+        nv->ip = idup(v->ip);
+        nv->filesz -= hi - v->start;
+        v->filesz -= v->end - lo;
+      }
+      nv->off += hi - v->start;
+      nv->start = hi;
+      v->end = lo;
+    }
+  }
+  return 0;
+}
+
+// Give the page at virtual address va a private, writable
+// copy, after a store to a copy-on-write page.
+// Returns 0 on success, -1 if va is not a copy-on-write
+// page or there is no memory.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+  mem = 0;
+  // the page table's lock is held while the page is looked
+  // at, but kalloc() must be called without it, so that it
+  // can reclaim memory.
+  acquire(PTLOCK(pagetable));
+  while((pte = walk(pagetable, va, 0)) != 0){
+    if((*pte & PTE_SWAP) && mem){
+      swapin(pte, mem);
+      mem = 0;
+      continue;
+    }
+    if((*pte & PTE_SWAP) == 0){
+      if((*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+        break;
+      pa = PTE2PA(*pte);
+      flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+      if(krefs((void*)pa) == 1){
+        // the other sharers have gone; no need to copy.
+        *pte = PA2PTE(pa) | flags;
+        release(PTLOCK(pagetable));
+        if(mem)
+          kfree(mem);
+        return 0;
+      }
+      if(mem){
+        memmove(mem, (char*)pa, PGSIZE);
+        *pte = PA2PTE(mem) | flags;
+        release(PTLOCK(pagetable));
+        // other threads may still see the old page.
+        tlbshootdown(pagetable);
+        kfree((void*)pa);
+        return 0;
+      }
+    }
+    release(PTLOCK(pagetable));
+    if((mem = kalloc()) == 0)
+      return -1;
+    acquire(PTLOCK(pagetable));
+  }
+  release(PTLOCK(pagetable));
+  if(mem)
+    kfree(mem);
   return -1;
 }
 
@@ -352,6 +879,32 @@ uvmclear(pagetable_t pagetable, uint64 va)
   *pte &= ~PTE_U;
 }
 
+// Return the PTE for user page va0, or 0 if it has no
+// page-table page. Remembers the PTEs of the calling process's
+// own pages in its software TLB, p->tlb: a PTE's address stays
+// good until exec() or exit() free the page table, though what
+// it holds may change, so callers still check the PTE itself.
+static pte_t*
+uwalk(pagetable_t pagetable, uint64 va0)
+{
+  struct proc *p = myproc();
+  struct tlbent *t;
+  pte_t *pte;
+
+  if(va0 >= MAXVA)
+    return 0;
+  if(p == 0 || pagetable != p->pagetable)
+    return walk(pagetable, va0, 0);
+  t = &p->tlb[(va0 >> PGSHIFT) % NTLB];
+  if(t->pte && t->va == va0)
+    return t->pte;
+  if((pte = walk(pagetable, va0, 0)) != 0){
+    t->va = va0;
+    t->pte = pte;
+  }
+  return pte;
+}
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
@@ -365,15 +918,24 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
     va0 = PGROUNDDOWN(dstva);
     if(va0 >= MAXVA)
       return -1;
-    pte = walk(pagetable, va0, 0);
-    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
-       (*pte & PTE_W) == 0)
-      return -1;
+    // the page table's lock is held while the page is in use,
+    // so that it can't be swapped out or unmapped.
+    acquire(PTLOCK(pagetable));
+    pte = uwalk(pagetable, va0);
+    if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_W)) != (PTE_V|PTE_U|PTE_W)){
+      release(PTLOCK(pagetable));
+      if((pte && (*pte & PTE_V) ? uvmcow(pagetable, va0) != 0 :
+          vmfault(pagetable, va0) == 0) && !uvmallows(pagetable, va0, PTE_W))
+        return -1;
+      continue;
+    }
+    *pte |= PTE_D;  // as the hardware would; see vmaflush()
     pa0 = PTE2PA(*pte);
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
     memmove((void *)(pa0 + (dstva - va0)), src, n);
+    release(PTLOCK(pagetable));
 
     len -= n;
     src += n;
@@ -389,16 +951,25 @@ int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
+  pte_t *pte;
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
+    // with the page table's lock held; see copyout().
+    acquire(PTLOCK(pagetable));
+    pte = uwalk(pagetable, va0);
+    if(pte == 0 || (*pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U)){
+      release(PTLOCK(pagetable));
+      if(vmfault(pagetable, va0) == 0 && !uvmallows(pagetable, va0, 0))
+        return -1;
+      continue;
+    }
+    pa0 = PTE2PA(*pte);
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
     memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    release(PTLOCK(pagetable));
 
     len -= n;
     dst += n;
@@ -414,20 +985,41 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 int
 copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
-  uint64 n, va0, pa0;
+  uint64 n, va0, pa0, w;
+  pte_t *pte;
   int got_null = 0;
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
+    // with the page table's lock held; see copyout().
+    acquire(PTLOCK(pagetable));
+    pte = uwalk(pagetable, va0);
+    if(pte == 0 || (*pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U)){
+      release(PTLOCK(pagetable));
+      if(vmfault(pagetable, va0) == 0 && !uvmallows(pagetable, va0, 0))
+        return -1;
+      continue;
+    }
+    pa0 = PTE2PA(*pte);
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
 
     char *p = (char *) (pa0 + (srcva - va0));
     while(n > 0){
+      // a word at a time while both are aligned and it
+      // has no zero byte.
+      if(n >= 8 && (((uint64)p | (uint64)dst) & 7) == 0){
+        w = *(uint64*)p;
+        if(((w - 0x0101010101010101UL) & ~w & 0x8080808080808080UL) == 0){
+          *(uint64*)dst = w;
+          n -= 8;
+          max -= 8;
+          p += 8;
+          dst += 8;
+          continue;
+        }
+      }
       if(*p == '\0'){
         *dst = '\0';
         got_null = 1;
@@ -440,6 +1032,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
       p++;
       dst++;
     }
+    release(PTLOCK(pagetable));
 
     srcva = va0 + PGSIZE;
   }
@@ -19,16 +19,20 @@
 
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
+// With blocks larger than SBOFF, the super block is in the boot block.
 
-int nbitmap = FSSIZE/BPB + 1;
-int ninodeblocks = NINODES / IPB + 1;
+uint bsize = BSIZE;     // Block size, set with -b
+uint fssize = FSSIZE;   // File system size in blocks, set with -s
+uint ninodes = NINODES; // Number of inodes, set with -i
+int nbitmap;
+int ninodeblocks;
 int nlog = LOGSIZE;
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
 int fsfd;
 struct superblock sb;
-char zeroes[BSIZE];
+char zeroes[MAXBSIZE];
 uint freeinode = 1;
 uint freeblock;
 
@@ -68,51 +72,88 @@ xint(uint x)
 int
 main(int argc, char *argv[])
 {
-  int i, cc, fd;
-  uint rootino, inum, off;
+  int i, cc, fd, opt;
+  uint rootino, inum, off, nboot;
   struct dirent de;
-  char buf[BSIZE];
+  char buf[MAXBSIZE];
   struct dinode din;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-  if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+  while((opt = getopt(argc, argv, "b:s:i:")) != -1){
+    switch(opt){
+    case 'b':
+      bsize = atoi(optarg);
+      break;
+    case 's':
+      fssize = atoi(optarg);
+      break;
+    case 'i':
+      ninodes = atoi(optarg);
+      break;
+    default:
+      optind = argc;
+      break;
+    }
+  }
+  if(optind >= argc){
+    fprintf(stderr, "Usage: mkfs [-b bsize] [-s fssize] [-i ninodes] fs.img files...\n");
+    exit(1);
+  }
+  argv += optind - 1;
+  argc -= optind - 1;
+
+  if(bsize < MINBSIZE || bsize > MAXBSIZE || (bsize & (bsize - 1))){
+    fprintf(stderr, "mkfs: block size must be a power of 2 from %d to %d\n",
+            MINBSIZE, MAXBSIZE);
+    exit(1);
+  }
+  if(ninodes < ROOTINO + 1 || ninodes > 65535){
+    fprintf(stderr, "mkfs: bad number of inodes %u\n", ninodes);
     exit(1);
   }
 
-  assert((BSIZE % sizeof(struct dinode)) == 0);
-  assert((BSIZE % sizeof(struct dirent)) == 0);
+  assert((bsize % sizeof(struct dinode)) == 0);
+  assert((bsize % sizeof(struct dirent)) == 0);
 
   fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0)
     die(argv[1]);
 
-  // 1 fs block = 1 disk sector
-  nmeta = 2 + nlog + ninodeblocks + nbitmap;
-  nblocks = FSSIZE - nmeta;
+  sb.bsize = xint(bsize);
+  nbitmap = fssize/BPB(sb) + 1;
+  ninodeblocks = ninodes / IPB(sb) + 1;
+
+  // boot and super block: 2 blocks if the super block has its own
+  nboot = SBOFF / bsize + 1;
+  nmeta = nboot + nlog + ninodeblocks + nbitmap;
+  if(fssize <= nmeta){
+    fprintf(stderr, "mkfs: file system of %u blocks is too small\n", fssize);
+    exit(1);
+  }
+  nblocks = fssize - nmeta;
 
   sb.magic = FSMAGIC;
-  sb.size = xint(FSSIZE);
+  sb.size = xint(fssize);
   sb.nblocks = xint(nblocks);
-  sb.ninodes = xint(NINODES);
+  sb.ninodes = xint(ninodes);
   sb.nlog = xint(nlog);
-  sb.logstart = xint(2);
-  sb.inodestart = xint(2+nlog);
-  sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.logstart = xint(nboot);
+  sb.inodestart = xint(nboot+nlog);
+  sb.bmapstart = xint(nboot+nlog+ninodeblocks);
 
-  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d bsize %d\n",
+         nmeta, nlog, ninodeblocks, nbitmap, nblocks, fssize, bsize);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
+  for(i = 0; i < fssize; i++)
     wsect(i, zeroes);
 
   memset(buf, 0, sizeof(buf));
-  memmove(buf, &sb, sizeof(sb));
-  wsect(1, buf);
+  memmove(buf + SBOFF % bsize, &sb, sizeof(sb));
+  wsect(SBOFF / bsize, buf);
 
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
@@ -165,7 +206,7 @@ main(int argc, char *argv[])
   // fix size of root inode dir
   rinode(rootino, &din);
   off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
+  off = ((off/bsize) + 1) * bsize;
   din.size = xint(off);
   winode(rootino, &din);
 
@@ -177,22 +218,22 @@ main(int argc, char *argv[])
 void
 wsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE)
+  if(lseek(fsfd, (off_t)sec * bsize, 0) != (off_t)sec * bsize)
     die("lseek");
-  if(write(fsfd, buf, BSIZE) != BSIZE)
+  if(write(fsfd, buf, bsize) != bsize)
     die("write");
 }
 
 void
 winode(uint inum, struct dinode *ip)
 {
-  char buf[BSIZE];
+  char buf[MAXBSIZE];
   uint bn;
   struct dinode *dip;
 
   bn = IBLOCK(inum, sb);
   rsect(bn, buf);
-  dip = ((struct dinode*)buf) + (inum % IPB);
+  dip = ((struct dinode*)buf) + (inum % IPB(sb));
   *dip = *ip;
   wsect(bn, buf);
 }
@@ -200,22 +241,22 @@ winode(uint inum, struct dinode *ip)
 void
 rinode(uint inum, struct dinode *ip)
 {
-  char buf[BSIZE];
+  char buf[MAXBSIZE];
   uint bn;
   struct dinode *dip;
 
   bn = IBLOCK(inum, sb);
   rsect(bn, buf);
-  dip = ((struct dinode*)buf) + (inum % IPB);
+  dip = ((struct dinode*)buf) + (inum % IPB(sb));
   *ip = *dip;
 }
 
 void
 rsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE)
+  if(lseek(fsfd, (off_t)sec * bsize, 0) != (off_t)sec * bsize)
     die("lseek");
-  if(read(fsfd, buf, BSIZE) != BSIZE)
+  if(read(fsfd, buf, bsize) != bsize)
     die("read");
 }
 
@@ -225,6 +266,7 @@ ialloc(ushort type)
   uint inum = freeinode++;
   struct dinode din;
 
+  assert(inum < ninodes);
   bzero(&din, sizeof(din));
   din.type = xshort(type);
   din.nlink = xshort(1);
@@ -236,17 +278,19 @@ ialloc(ushort type)
 void
 balloc(int used)
 {
-  uchar buf[BSIZE];
-  int i;
+  uchar buf[MAXBSIZE];
+  int i, b;
 
   printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BPB);
-  bzero(buf, BSIZE);
-  for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+  assert(used < fssize);
+  for(b = 0; b < used; b += BPB(sb)){
+    bzero(buf, bsize);
+    for(i = b; i < used && i < b + BPB(sb); i++){
+      buf[(i-b)/8] = buf[(i-b)/8] | (0x1 << ((i-b)%8));
+    }
+    printf("balloc: write bitmap block at sector %d\n", BBLOCK(b, sb));
+    wsect(BBLOCK(b, sb), buf);
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
@@ -257,16 +301,33 @@ iappend(uint inum, void *xp, int n)
   char *p = (char*)xp;
   uint fbn, off, n1;
   struct dinode din;
-  char buf[BSIZE];
-  uint indirect[NINDIRECT];
+  char buf[MAXBSIZE];
+  uint indirect[MAXBSIZE / sizeof(uint)];
   uint x;
 
   rinode(inum, &din);
   off = xint(din.size);
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
+  if(xshort(din.type) == T_FILE && off <= INLINESIZE){
+    if(off + n <= INLINESIZE){
+      // small files keep their data in addrs[]
+      bcopy(p, (char*)din.addrs + off, n);
+      din.size = xint(off + n);
+      winode(inum, &din);
+      return;
+    }
+    if(off > 0){
+      // growing out of the inode: move the data to a block
+      bzero(buf, sizeof(buf));
+      bcopy(din.addrs, buf, off);
+      bzero(din.addrs, sizeof(din.addrs));
+      din.addrs[0] = xint(freeblock++);
+      wsect(xint(din.addrs[0]), buf);
+    }
+  }
   while(n > 0){
-    fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
+    fbn = off / bsize;
+    assert(fbn < MAXFILE(sb));
     if(fbn < NDIRECT){
       if(xint(din.addrs[fbn]) == 0){
         din.addrs[fbn] = xint(freeblock++);
@@ -283,9 +344,9 @@ iappend(uint inum, void *xp, int n)
       }
       x = xint(indirect[fbn-NDIRECT]);
     }
-    n1 = min(n, (fbn + 1) * BSIZE - off);
+    n1 = min(n, (fbn + 1) * bsize - off);
     rsect(x, buf);
-    bcopy(p, buf + off - (fbn * BSIZE), n1);
+    bcopy(p, buf + off - (fbn * bsize), n1);
     wsect(x, buf);
     n -= n1;
     off += n1;
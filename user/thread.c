@@ -0,0 +1,104 @@
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "user/user.h"
+
+// Threads made with clone(), each running on a stack from
+// malloc() that thread_join() frees. The top TLSSIZE bytes
+// of the stack's block are the thread's thread-local
+// storage, which the kernel points tp at.
+
+#define STACKSIZE (16*1024)
+#define TLSSIZE 256
+
+struct start {
+  void (*fn)(void*);
+  void *arg;
+};
+
+static struct {
+  int tid;
+  char *stack;  // 0 if the slot is free
+} threads[NPROC];
+
+static void
+threadstart(void *a)
+{
+  struct start *st = a;
+
+  st->fn(st->arg);
+  exit(0);
+}
+
+// Start a thread running fn(arg).
+// Returns its id, or -1.
+int
+thread_create(void (*fn)(void*), void *arg)
+{
+  char *stack, *tls;
+  struct start *st;
+  int i, tid;
+
+  if((stack = malloc(STACKSIZE)) == 0)
+    return -1;
+  for(i = 0; i < NPROC; i++)
+    if(__sync_bool_compare_and_swap(&threads[i].stack, 0, stack))
+      break;
+  if(i == NPROC){
+    free(stack);
+    return -1;
+  }
+  tls = stack + STACKSIZE - TLSSIZE;
+  memset(tls, 0, TLSSIZE);
+  // fn and arg sit at the top of the stack, below the TLS.
+  st = (struct start*)tls - 1;
+  st->fn = fn;
+  st->arg = arg;
+  if((tid = clone(threadstart, st, st, tls)) < 0){
+    threads[i].stack = 0;
+    free(stack);
+    return -1;
+  }
+  threads[i].tid = tid;
+  return tid;
+}
+
+// Wait for thread tid (or any thread, if tid is 0) to
+// exit, and free its stack.
+// Returns its exit status, or -1.
+int
+thread_join(int tid)
+{
+  char *stack;
+  int i, xstatus;
+
+  if((tid = join(tid, &xstatus)) < 0)
+    return -1;
+  for(i = 0; i < NPROC; i++){
+    if(threads[i].stack && threads[i].tid == tid){
+      stack = threads[i].stack;
+      threads[i].tid = 0;
+      __sync_lock_release(&threads[i].stack);
+      free(stack);
+      break;
+    }
+  }
+  return xstatus;
+}
+
+// Return the calling thread's TLSSIZE bytes of thread-local
+// storage, zeroed when the thread started. The main thread
+// gets its block on first use.
+void*
+thread_tls(void)
+{
+  char *tls;
+
+  asm volatile("mv %0, tp" : "=r" (tls));
+  if(tls == 0){
+    if((tls = malloc(TLSSIZE)) == 0)
+      return 0;
+    memset(tls, 0, TLSSIZE);
+    asm volatile("mv tp, %0" : : "r" (tls));
+  }
+  return tls;
+}
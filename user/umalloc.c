@@ -2,9 +2,11 @@
 #include "kernel/stat.h"
 #include "user/user.h"
 #include "kernel/param.h"
+#include "kernel/fcntl.h"
 
 // Memory allocator by Kernighan and Ritchie,
 // The C programming Language, 2nd ed.  Section 8.7.
+// A futex-based lock makes it safe for threads.
 
 typedef long Align;
 
@@ -20,9 +22,35 @@ typedef union header Header;
 
 static Header base;
 static Header *freep;
+static int lock;  // 0 free, 1 held, 2 held with waiters
 
-void
-free(void *ap)
+static void
+acquire(void)
+{
+  int c;
+
+  if((c = __sync_val_compare_and_swap(&lock, 0, 1)) == 0)
+    return;
+  if(c != 2)
+    c = __sync_lock_test_and_set(&lock, 2);
+  while(c != 0){
+    futex(&lock, FUTEX_WAIT, 2);
+    c = __sync_lock_test_and_set(&lock, 2);
+  }
+}
+
+static void
+release(void)
+{
+  if(__sync_fetch_and_sub(&lock, 1) != 1){
+    lock = 0;
+    __sync_synchronize();
+    futex(&lock, FUTEX_WAKE, 1);
+  }
+}
+
+static void
+freelocked(void *ap)
 {
   Header *bp, *p;
 
@@ -43,6 +71,14 @@ free(void *ap)
   freep = p;
 }
 
+void
+free(void *ap)
+{
+  acquire();
+  freelocked(ap);
+  release();
+}
+
 static Header*
 morecore(uint nu)
 {
@@ -56,7 +92,7 @@ morecore(uint nu)
     return 0;
   hp = (Header*)p;
   hp->s.size = nu;
-  free((void*)(hp + 1));
+  freelocked((void*)(hp + 1));
   return freep;
 }
 
@@ -67,6 +103,7 @@ malloc(uint nbytes)
   uint nunits;
 
   nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
+  acquire();
   if((prevp = freep) == 0){
     base.s.ptr = freep = prevp = &base;
     base.s.size = 0;
@@ -81,10 +118,13 @@ malloc(uint nbytes)
         p->s.size = nunits;
       }
       freep = prevp;
+      release();
       return (void*)(p + 1);
     }
     if(p == freep)
-      if((p = morecore(nunits)) == 0)
+      if((p = morecore(nunits)) == 0){
+        release();
         return 0;
+      }
   }
 }
@@ -22,6 +22,15 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int nice(int);
+int nanosleep(uint64);
+int setaffinity(int, uint);
+void* mmap(void*, uint64, int, int, int, uint64);
+int munmap(void*, uint64);
+int splice(int, int, int);
+int futex(int*, int, int);
+int clone(void(*)(void*), void*, void*, void*);
+int join(int, int*);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -41,3 +50,8 @@ void *memcpy(void *, const void *, uint);
 // umalloc.c
 void* malloc(uint);
 void free(void*);
+
+// thread.c
+int thread_create(void(*)(void*), void*);
+int thread_join(int);
+void* thread_tls(void);
@@ -19,6 +19,10 @@
 
 #define BUFSZ  ((MAXOPBLOCKS+2)*BSIZE)
 
+// max file size, in blocks, on a file system made with the
+// default block size
+#define DEFMAXFILE (NDIRECT + BSIZE / sizeof(uint))
+
 char buf[BUFSZ];
 
 //
@@ -421,6 +425,41 @@ truncate3(char *s)
   unlink("truncfile");
   exit(xstatus);
 }
+
+// grow a file a few bytes at a time across the size that
+// fits in the inode, and check that its data survives.
+void
+inlinefile(char *s)
+{
+  char buf[128], rbuf[128];
+  int fd, i, n;
+
+  for(i = 0; i < sizeof(buf); i++)
+    buf[i] = 'a' + i % 23;
+
+  unlink("inlinefile");
+  for(n = 0; n < sizeof(buf); n += 8){
+    // append 8 bytes at offset n
+    fd = open("inlinefile", O_CREATE|O_RDWR);
+    if(fd < 0){
+      printf("%s: open failed\n", s);
+      exit(1);
+    }
+    if(read(fd, rbuf, n) != n || write(fd, buf + n, 8) != 8){
+      printf("%s: append at %d failed\n", s, n);
+      exit(1);
+    }
+    close(fd);
+
+    fd = open("inlinefile", O_RDONLY);
+    if(read(fd, rbuf, sizeof(rbuf)) != n + 8 || memcmp(buf, rbuf, n + 8) != 0){
+      printf("%s: wrong contents at size %d\n", s, n + 8);
+      exit(1);
+    }
+    close(fd);
+  }
+  unlink("inlinefile");
+}
   
 
 // does chdir() call iput(p->cwd) in a transaction?
@@ -589,7 +628,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < DEFMAXFILE; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed i=%d\n", s, i);
@@ -609,7 +648,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n != MAXFILE){
+      if(n != DEFMAXFILE){
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
@@ -818,6 +857,852 @@ killstatus(char *s)
   exit(0);
 }
 
+// nice() clamps to 0..19 and is inherited across fork.
+void
+nicetest(char *s)
+{
+  int n, pid, xst;
+
+  if((n = nice(0)) != 0){
+    printf("%s: initial nice %d, expected 0\n", s, n);
+    exit(1);
+  }
+  if((n = nice(5)) != 5 || (n = nice(100)) != 19){
+    printf("%s: nice returned %d\n", s, n);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0)
+    exit(nice(0));
+  wait(&xst);
+  if(xst != 19){
+    printf("%s: child nice %d, expected 19\n", s, xst);
+    exit(1);
+  }
+  if((n = nice(-100)) != 0){
+    printf("%s: nice returned %d, expected 0\n", s, n);
+    exit(1);
+  }
+}
+
+// nanosleep() sleeps at least as long as asked, and a
+// sleeper can still be killed.
+void
+nanosleeptest(char *s)
+{
+  int t0, t1, pid, xst;
+
+  t0 = uptime();
+  if(nanosleep(300000000ULL) != 0){
+    printf("%s: nanosleep failed\n", s);
+    exit(1);
+  }
+  t1 = uptime();
+  if(t1 - t0 < 3){
+    printf("%s: slept %d ticks, expected at least 3\n", s, t1 - t0);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    // a deadline this far out must not wrap around to the past.
+    nanosleep(~0ULL);
+    exit(0);
+  }
+  sleep(1);
+  kill(pid);
+  wait(&xst);
+  if(xst != -1){
+    printf("%s: status should be -1\n", s);
+    exit(1);
+  }
+}
+
+// setaffinity() returns the old mask, rejects an empty one,
+// and the mask is inherited across fork.
+void
+affinitytest(char *s)
+{
+  int all, pid, xst;
+
+  if((all = setaffinity(0, 1)) <= 0 || (all & 1) == 0){
+    printf("%s: setaffinity returned %d\n", s, all);
+    exit(1);
+  }
+  if(setaffinity(0, 0) != -1){
+    printf("%s: empty mask accepted\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0)
+    exit(setaffinity(0, all));
+  wait(&xst);
+  if(xst != 1){
+    printf("%s: child mask %d, expected 1\n", s, xst);
+    exit(1);
+  }
+  if(setaffinity(0, all) != 1){
+    printf("%s: mask not kept\n", s);
+    exit(1);
+  }
+}
+
+// after fork, stores by either process, including stores by
+// the kernel via read(), must not be seen by the other.
+void
+cowtest(char *s)
+{
+  enum { N = 64*4096 };
+  char *a;
+  int i, pid, xst, fds[2];
+
+  a = sbrk(N);
+  if(a == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i += 4096)
+    a[i] = 'p';
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < N; i += 4096)
+      if(a[i] != 'p')
+        exit(1);
+    for(i = 0; i < N/2; i += 4096)
+      a[i] = 'c';
+    // the kernel stores into a page still shared with the parent.
+    if(read(fds[0], a + N/2, 1) != 1 || a[N/2] != 'x')
+      exit(1);
+    exit(0);
+  }
+  if(write(fds[1], "x", 1) != 1){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  wait(&xst);
+  if(xst != 0){
+    printf("%s: child saw the wrong data\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i += 4096){
+    if(a[i] != 'p'){
+      printf("%s: parent saw the child's store at %d\n", s, i);
+      exit(1);
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+  sbrk(-N);
+}
+
+// sbrk() only reserves memory: a reservation far larger than
+// physical memory succeeds, and pages are zero on first use,
+// whether touched by the program or by the kernel.
+void
+lazysbrk(char *s)
+{
+  enum { HUGE = 1024*1024*1024 };
+  char *a;
+  int fds[2];
+
+  a = sbrk(HUGE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  if(a[HUGE/2] != 0){
+    printf("%s: untouched page not zero\n", s);
+    exit(1);
+  }
+  a[0] = 1;
+  a[HUGE-1] = 2;
+  if(pipe(fds) != 0 || write(fds[1], "x", 1) != 1){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(read(fds[0], a + HUGE/4, 1) != 1){
+    printf("%s: read into untouched page failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  if(a[0] != 1 || a[HUGE-1] != 2 || a[HUGE/4] != 'x'){
+    printf("%s: wrong data\n", s);
+    exit(1);
+  }
+  sbrk(-HUGE);
+}
+
+// exec maps the program's pages in on demand. check that
+// text is read-only and that the kernel can copy to and from
+// text and data pages, even with a pipe's lock held.
+int demanddata[1024] = { 1, 2, 3 };
+
+void
+demandexec(char *s)
+{
+  char buf[64];
+  int pid, xst, fds[2];
+  char *text = (char*)demandexec;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    *(volatile char*)text = 0;
+    exit(0);
+  }
+  wait(&xst);
+  if(xst != -1){
+    printf("%s: store to text succeeded\n", s);
+    exit(1);
+  }
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], text, sizeof(buf)) != sizeof(buf) ||
+     read(fds[0], buf, sizeof(buf)) != sizeof(buf) ||
+     memcmp(buf, text, sizeof(buf)) != 0){
+    printf("%s: copy from text failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], "xyz", 3) != 3 ||
+     read(fds[0], (char*)&demanddata[1000], 3) != 3 ||
+     memcmp(&demanddata[1000], "xyz", 3) != 0){
+    printf("%s: copy to data failed\n", s);
+    exit(1);
+  }
+  if(demanddata[0] != 1 || demanddata[2] != 3 || demanddata[500] != 0){
+    printf("%s: wrong initial data\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// the kernel's file table grows on demand: together these
+// children hold more open files than the old fixed table of
+// 100 did.
+void
+manyfiles(char *s)
+{
+  enum { NCHILD = 12 };
+  int i, j, pid, xst, fds[2], ready[2];
+  char c;
+
+  if(pipe(ready) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(ready[1]);
+      for(j = 0; j < 5; j++){
+        if(pipe(fds) != 0)
+          exit(1);
+      }
+      // hold them until every child has its files open.
+      read(ready[0], &c, 1);
+      exit(0);
+    }
+  }
+  close(ready[0]);
+  sleep(5);
+  close(ready[1]);
+  for(i = 0; i < NCHILD; i++){
+    wait(&xst);
+    if(xst != 0){
+      printf("%s: child could not open its files\n", s);
+      exit(1);
+    }
+  }
+}
+
+// mmap() a file both ways: a MAP_PRIVATE mapping's changes
+// stay in the process, a MAP_SHARED one's are seen by a
+// forked child and reach the file after munmap().
+void
+mmaptest(char *s)
+{
+  enum { N = 2*4096 + 100 };
+  char *file = "mmapfile";
+  static char buf[N], buf2[N + 1];
+  char *a;
+  int fd, fd2, i, pid, xst;
+
+  // every byte value, so that the file is not compressed.
+  for(i = 0; i < N; i++)
+    buf[i] = i % 251;
+  unlink(file);
+  fd = open(file, O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, buf, N) != N){
+    printf("%s: create %s failed\n", s, file);
+    exit(1);
+  }
+
+  a = mmap(0, N, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(a == (char*)-1){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  if(memcmp(a, buf, N) != 0 || a[N] != 0){
+    printf("%s: private mapping has wrong data\n", s);
+    exit(1);
+  }
+  a[0] = 'X';
+  if(munmap(a, N) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  a = mmap(0, N, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(a == (char*)-1){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  if(a[0] != buf[0]){
+    printf("%s: private change reached the file\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    a[1] = 'Y';
+    a[N-1] = 'Z';
+    exit(0);
+  }
+  wait(&xst);
+  if(xst != 0 || a[1] != 'Y' || a[N-1] != 'Z'){
+    printf("%s: child's change not shared\n", s);
+    exit(1);
+  }
+  // write() to a page that is mapped shared, and dirty: the
+  // mapping sees the new data, and writing the page back at
+  // munmap() keeps it.
+  a[4096+100] = 'Q';
+  fd2 = open(file, O_RDWR);
+  if(fd2 < 0 || read(fd2, buf2, 4096) != 4096 || write(fd2, "WWW", 3) != 3){
+    printf("%s: write to mapped file failed\n", s);
+    exit(1);
+  }
+  close(fd2);
+  if(a[4096] != 'W' || a[4098] != 'W' || a[4096+100] != 'Q'){
+    printf("%s: shared mapping missed write()\n", s);
+    exit(1);
+  }
+  if(munmap(a, N) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  buf[1] = 'Y';
+  buf[N-1] = 'Z';
+  memset(buf + 4096, 'W', 3);
+  buf[4096+100] = 'Q';
+  fd = open(file, O_RDONLY);
+  if(fd < 0 || read(fd, buf2, N + 1) != N || memcmp(buf2, buf, N) != 0){
+    printf("%s: shared changes not written back\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink(file);
+}
+
+// a compressed file reads back as written, through the page
+// cache, and a write to part of it stores it plainly.
+void
+compressedfile(char *s)
+{
+  enum { N = 3000 };
+  char *file = "compfile";
+  static char buf[N], buf2[N + 1];
+  struct stat st;
+  int fd, i;
+
+  // few byte values, so that the file is compressed.
+  for(i = 0; i < N; i++)
+    buf[i] = 'a' + i % 4;
+  unlink(file);
+  fd = open(file, O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, buf, N) != N){
+    printf("%s: create %s failed\n", s, file);
+    exit(1);
+  }
+  if(fstat(fd, &st) < 0 || st.size != N){
+    printf("%s: wrong size %d\n", s, (int)st.size);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open(file, O_RDWR);
+  if(fd < 0 || read(fd, buf2, N + 1) != N || memcmp(buf2, buf, N) != 0){
+    printf("%s: read back wrong data\n", s);
+    exit(1);
+  }
+  memset(buf + 1000, 'x', 100);
+  close(fd);
+  fd = open(file, O_RDWR);
+  if(fd < 0 || read(fd, buf2, 1000) != 1000 || write(fd, buf + 1000, 100) != 100){
+    printf("%s: partial write failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open(file, O_RDONLY);
+  if(fd < 0 || read(fd, buf2, N + 1) != N || memcmp(buf2, buf, N) != 0){
+    printf("%s: partial write lost data\n", s);
+    exit(1);
+  }
+  if(fstat(fd, &st) < 0 || st.size != N){
+    printf("%s: wrong size %d after partial write\n", s, (int)st.size);
+    exit(1);
+  }
+  close(fd);
+  unlink(file);
+}
+
+// copies to and from user memory at every alignment, across
+// page boundaries, and strings whose end falls inside a word.
+void
+copyalign(char *s)
+{
+  enum { N = 4096 + 64 };
+  static char src[N + 8], dst[N + 8];
+  char path[MAXPATH + 8];
+  int fd, i, j, n;
+
+  for(i = 0; i < N + 8; i++)
+    src[i] = i % 253 + 1;
+  for(i = 0; i < 8; i++){
+    for(j = 0; j < 8; j++){
+      n = N - i - j;
+      unlink("copyalign");
+      fd = open("copyalign", O_CREATE|O_RDWR);
+      if(fd < 0 || write(fd, src + i, n) != n){
+        printf("%s: write at %d failed\n", s, i);
+        exit(1);
+      }
+      close(fd);
+      memset(dst, 0, sizeof(dst));
+      fd = open("copyalign", O_RDONLY);
+      if(fd < 0 || read(fd, dst + j, n) != n || memcmp(dst + j, src + i, n) != 0){
+        printf("%s: read %d to %d came back wrong\n", s, i, j);
+        exit(1);
+      }
+      close(fd);
+    }
+  }
+  unlink("copyalign");
+
+  for(i = 0; i < 8; i++){
+    for(j = 1; j < 20; j++){
+      memset(path, 'p', sizeof(path));
+      path[i + j] = 0;
+      fd = open(path + i, O_CREATE|O_RDWR);
+      if(fd < 0){
+        printf("%s: create of %d-byte name failed\n", s, j);
+        exit(1);
+      }
+      close(fd);
+      if(unlink(path + i) != 0){
+        printf("%s: unlink of %d-byte name failed\n", s, j);
+        exit(1);
+      }
+    }
+  }
+}
+
+// pipe writes and reads bigger than the pipe's buffer, of
+// sizes that make the data wrap round it at odd places.
+void
+pipebig(char *s)
+{
+  enum { N = 200000, MAX = 9000 };
+  static char b[MAX];
+  int fds[2], pid, xst, i, n, m, seq, total;
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork() failed\n", s);
+    exit(1);
+  }
+  seq = 0;
+  if(pid == 0){
+    close(fds[0]);
+    for(total = 0, m = 1; total < N; total += m, m = (m * 7 + 3) % MAX + 1){
+      if(m > N - total)
+        m = N - total;
+      for(i = 0; i < m; i++)
+        b[i] = seq++ % 251;
+      if(write(fds[1], b, m) != m){
+        printf("%s: write failed\n", s);
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+  close(fds[1]);
+  for(total = 0, m = 5; (n = read(fds[0], b, m)) > 0; m = (m * 5 + 1) % MAX + 1){
+    for(i = 0; i < n; i++){
+      if((uchar)b[i] != seq++ % 251){
+        printf("%s: wrong data at %d\n", s, total + i);
+        exit(1);
+      }
+    }
+    total += n;
+  }
+  close(fds[0]);
+  wait(&xst);
+  if(total != N || xst != 0){
+    printf("%s: read %d bytes\n", s, total);
+    exit(1);
+  }
+}
+
+// splice() a file into a pipe and the pipe into another file.
+void
+splicetest(char *s)
+{
+  enum { N = 3*4096 + 500 };
+  static char b[N], b2[N + 1];
+  int fds[2], in, out, pid, xst, i, n, total;
+
+  for(i = 0; i < N; i++)
+    b[i] = i % 251;
+  unlink("splicein");
+  unlink("spliceout");
+  in = open("splicein", O_CREATE|O_RDWR);
+  if(in < 0 || write(in, b, N) != N){
+    printf("%s: create splicein failed\n", s);
+    exit(1);
+  }
+  close(in);
+  in = open("splicein", O_RDONLY);
+  out = open("spliceout", O_CREATE|O_RDWR);
+  if(in < 0 || out < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  if(splice(in, out, 10) != -1){
+    printf("%s: splice between files succeeded\n", s);
+    exit(1);
+  }
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork() failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    for(total = 0; (n = splice(in, fds[1], 5000)) > 0; total += n)
+      ;
+    exit(n < 0 || total != N);
+  }
+  close(fds[1]);
+  for(total = 0; (n = splice(fds[0], out, N)) > 0; total += n)
+    ;
+  wait(&xst);
+  if(n < 0 || total != N || xst != 0){
+    printf("%s: spliced %d bytes\n", s, total);
+    exit(1);
+  }
+  close(fds[0]);
+  close(in);
+  close(out);
+
+  out = open("spliceout", O_RDONLY);
+  if(out < 0 || read(out, b2, N + 1) != N || memcmp(b, b2, N) != 0){
+    printf("%s: spliced data wrong\n", s);
+    exit(1);
+  }
+  close(out);
+  unlink("splicein");
+  unlink("spliceout");
+}
+
+// processes share MAP_SHARED|MAP_ANON memory across fork(),
+// and take turns through it using futex() to wait. private
+// anonymous memory is not shared.
+void
+shmfutex(char *s)
+{
+  enum { N = 200 };
+  volatile int *turn;
+  char *priv;
+  int pid, xst, i, me;
+
+  turn = mmap(0, 2*4096, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
+  priv = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+  if(turn == (int*)-1 || priv == (char*)-1){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if(turn[0] != 0 || turn[2*1024-1] != 0 || priv[0] != 0){
+    printf("%s: anonymous memory not zeroed\n", s);
+    exit(1);
+  }
+  if(futex((int*)turn, FUTEX_WAIT, 1) != -1){
+    printf("%s: futex wait on wrong value slept\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  me = pid == 0;
+  if(me)
+    priv[0] = 'c';
+  for(i = 0; i < N; i++){
+    // parent's turn when even, child's when odd.
+    while(turn[0] % 2 != me)
+      futex((int*)turn, FUTEX_WAIT, turn[0]);
+    turn[2*1024-1] += 1;
+    __sync_synchronize();
+    turn[0] += 1;
+    futex((int*)turn, FUTEX_WAKE, 1);
+  }
+  if(me)
+    exit(0);
+  wait(&xst);
+  if(xst != 0 || turn[0] != 2*N || turn[2*1024-1] != 2*N){
+    printf("%s: turns went wrong: %d %d\n", s, turn[0], turn[2*1024-1]);
+    exit(1);
+  }
+  if(priv[0] != 0){
+    printf("%s: private memory shared\n", s);
+    exit(1);
+  }
+  if(munmap((void*)turn, 2*4096) != 0 || munmap(priv, 4096) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+}
+
+static int thrlock, thrcount, thrfd = -1, thrbadtls;
+
+static void
+threadwork(void *arg)
+{
+  char *p;
+  int i, *tls;
+
+  tls = thread_tls();
+  if(*tls != 0)
+    thrbadtls = 1;
+  *tls = getpid();
+  for(i = 0; i < 500; i++){
+    if(*(int*)thread_tls() != getpid())
+      thrbadtls = 1;
+    p = malloc(32 + i % 64);
+    p[0] = i;
+    while(__sync_lock_test_and_set(&thrlock, 1))
+      futex(&thrlock, FUTEX_WAIT, 1);
+    thrcount += 1;
+    __sync_lock_release(&thrlock);
+    futex(&thrlock, FUTEX_WAKE, 1);
+    free(p);
+  }
+  if(arg)
+    thrfd = open("threadf", O_CREATE|O_RDWR);
+}
+
+static void
+threadspin(void *arg)
+{
+  for(;;)
+    ;
+}
+
+// threads share memory, malloc() and open files, but not
+// thread-local storage; a process that exits takes its
+// threads with it.
+void
+threadtest(char *s)
+{
+  enum { NT = 4 };
+  char *argv[] = { "echo", "x", 0 };
+  int tid[NT], i, pid, xst, *tls;
+
+  tls = thread_tls();
+  *tls = getpid();
+  for(i = 0; i < NT; i++){
+    if((tid[i] = thread_create(threadwork, (void*)(uint64)(i == 0))) < 0){
+      printf("%s: thread_create failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < NT; i++){
+    if(thread_join(tid[i]) != 0){
+      printf("%s: thread_join failed\n", s);
+      exit(1);
+    }
+  }
+  if(thrcount != NT*500){
+    printf("%s: count %d, not %d\n", s, thrcount, NT*500);
+    exit(1);
+  }
+  if(thrbadtls || thread_tls() != tls || *tls != getpid()){
+    printf("%s: thread-local storage shared\n", s);
+    exit(1);
+  }
+  if(thrfd < 0 || write(thrfd, "x", 1) != 1){
+    printf("%s: thread's file not shared\n", s);
+    exit(1);
+  }
+  close(thrfd);
+  unlink("threadf");
+  if(join(0, 0) != -1){
+    printf("%s: join with no threads succeeded\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(thread_create(threadspin, 0) < 0)
+      exit(1);
+    if(exec("echo", argv) != -1)
+      exit(2);
+    exit(7);
+  }
+  if(wait(&xst) != pid || xst != 7){
+    printf("%s: process with threads exited %d\n", s, xst);
+    exit(1);
+  }
+}
+
+static volatile int *spinpage;
+static volatile int spinning, spinbad;
+
+static void
+threadreadspin(void *arg)
+{
+  for(;;){
+    if(*spinpage != 0x5a5a5a5a)
+      spinbad = 1;
+    spinning = 1;
+  }
+}
+
+// a thread spinning on a page that another thread munmap()s
+// must fault, not go on reading the page after it's freed
+// and reused.
+void
+munmapspin(char *s)
+{
+  enum { N = 64 };
+  int tid, i, j;
+  char *a;
+
+  spinpage = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, -1, 0);
+  if(spinpage == (int*)0xffffffffffffffffL){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  *spinpage = 0x5a5a5a5a;
+  if((tid = thread_create(threadreadspin, 0)) < 0){
+    printf("%s: thread_create failed\n", s);
+    exit(1);
+  }
+  while(spinning == 0)
+    ;
+  if(munmap((void*)spinpage, 4096) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  // reuse the freed page, with other contents.
+  for(i = 0; i < 10; i++){
+    if((a = sbrk(N*4096)) == (char*)0xffffffffffffffffL){
+      printf("%s: sbrk failed\n", s);
+      exit(1);
+    }
+    for(j = 0; j < N; j++)
+      *(int*)(a + j*4096) = i;
+    sbrk(-N*4096);
+  }
+  if(thread_join(tid) != -1){
+    printf("%s: spinning thread didn't fault\n", s);
+    exit(1);
+  }
+  if(spinbad){
+    printf("%s: thread read a freed page\n", s);
+    exit(1);
+  }
+}
+
+// touch more memory than the machine has; the kernel must
+// compress pages that haven't been used lately to make room,
+// and bring them back intact.
+void
+swaptest(char *s)
+{
+  enum { BIG = 128*1024*1024 };
+  char *a;
+  uint64 i;
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < BIG; i += 4096)
+    *(uint64*)(a + i) = i;
+  for(i = 0; i < BIG; i += 4096){
+    if(*(uint64*)(a + i) != i || a[i + 4095] != 0){
+      printf("%s: wrong data at %ld\n", s, i);
+      exit(1);
+    }
+  }
+  sbrk(-BIG);
+}
+
 // meant to be run w/ at most two CPUs
 void
 preempt(char *s)
@@ -2599,6 +3484,7 @@ struct test {
   {truncate1, "truncate1"},
   {truncate2, "truncate2"},
   {truncate3, "truncate3"},
+  {inlinefile, "inlinefile"},
   {openiputtest, "openiput"},
   {exitiputtest, "exitiput"},
   {iputtest, "iput"},
@@ -2610,6 +3496,21 @@ struct test {
   {exectest, "exectest"},
   {pipe1, "pipe1"},
   {killstatus, "killstatus"},
+  {nicetest, "nicetest"},
+  {nanosleeptest, "nanosleeptest"},
+  {affinitytest, "affinitytest"},
+  {cowtest, "cowtest"},
+  {lazysbrk, "lazysbrk"},
+  {demandexec, "demandexec"},
+  {manyfiles, "manyfiles"},
+  {mmaptest, "mmaptest"},
+  {compressedfile, "compressedfile"},
+  {copyalign, "copyalign"},
+  {pipebig, "pipebig"},
+  {splicetest, "splicetest"},
+  {shmfutex, "shmfutex"},
+  {threadtest, "threadtest"},
+  {munmapspin, "munmapspin"},
   {preempt, "preempt"},
   {exitwait, "exitwait"},
   {reparent, "reparent" },
@@ -2851,7 +3752,7 @@ diskfull(char *s)
       done = 1;
       break;
     }
-    for(int i = 0; i < MAXFILE; i++){
+    for(int i = 0; i < DEFMAXFILE; i++){
       char buf[BSIZE];
       if(write(fd, buf, BSIZE) != BSIZE){
         done = 1;
@@ -2946,6 +3847,7 @@ struct test slowtests[] = {
   {execout, "execout"},
   {diskfull, "diskfull"},
   {outofinodes, "outofinodes"},
+  {swaptest, "swaptest"},
     
   { 0, 0},
 };
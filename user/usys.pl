@@ -36,3 +36,12 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("nice");
+entry("nanosleep");
+entry("setaffinity");
+entry("mmap");
+entry("munmap");
+entry("splice");
+entry("futex");
+entry("clone");
+entry("join");